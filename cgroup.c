@@ -0,0 +1,235 @@
+#include "shell.h"
+
+/* Containment of jobs in cgroup v2. The shell needs a delegated cgroup,
+ * i.e. one it may create children in and move processes between, e.g.
+ * from `systemd-run --user --scope -p Delegate=yes`. Since a cgroup that
+ * distributes resources to its children must not have processes itself,
+ * the shell moves itself into a "shell" leaf and creates a "job.PID.N"
+ * sibling for each contained job. The shell itself never enters a job's
+ * cgroup: processes are created right in it, see spawn.c, so they never run
+ * outside of it.
+ * If there is no usable cgroup, jobs run without containment. */
+
+static char *cgbase = NULL; /* delegated cgroup or NULL if not usable */
+static bool cginitdone = false;
+static int cgnext = 1; /* number of the next job's cgroup */
+static bool cgcpu, cgmem; /* controllers enabled for jobs' cgroups */
+static bool cgcpuown, cgmemown; /* ... and were enabled by this shell */
+
+static bool cgwrite(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = strlen(value);
+  bool ok = write(fd, value, len) == len;
+  int err = errno;
+  Close(fd);
+  errno = err;
+  return ok;
+}
+
+/* Reads contents of a small file. Returns false if it does not exist. */
+static bool cgread(const char *dir, const char *file, char *buf, size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  ssize_t len = read(fd, buf, size - 1);
+  Close(fd);
+  if (len < 0)
+    return false;
+  buf[len] = '\0';
+  return true;
+}
+
+/* Is `name` on space separated list of controllers? */
+static bool cghas(const char *list, const char *name) {
+  size_t len = strlen(name);
+  for (const char *s = list; (s = strstr(s, name)); s += len)
+    if ((s == list || s[-1] == ' ') && (s[len] == '\0' || isspace(s[len])))
+      return true;
+  return false;
+}
+
+static void cgpath(char *buf, size_t size, int cg) {
+  snprintf(buf, size, "%s/job.%d.%d", cgbase, getpid(), cg);
+}
+
+/* Finds the mount point of cgroup v2 hierarchy and shell's cgroup in it. */
+static char *cgself(void) {
+  char mnt[PATH_MAX] = "", line[PATH_MAX + 256];
+  FILE *f;
+
+  if ((f = fopen("/proc/self/mountinfo", "re")) == NULL)
+    return NULL;
+  while (fgets(line, sizeof(line), f)) {
+    char dir[PATH_MAX], *sep = strstr(line, " - ");
+    if (sep && !strncmp(sep, " - cgroup2 ", 11) &&
+        sscanf(line, "%*s %*s %*s %*s %s", dir) == 1) {
+      strcpy(mnt, dir);
+      break;
+    }
+  }
+  fclose(f);
+
+  if (*mnt == '\0' || (f = fopen("/proc/self/cgroup", "re")) == NULL)
+    return NULL;
+  char *self = NULL;
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, "0::", 3)) {
+      line[strcspn(line, "\n")] = '\0';
+      strncat(mnt, strcmp(line + 3, "/") ? line + 3 : "",
+              sizeof(mnt) - strlen(mnt) - 1);
+      self = strdup(mnt);
+      break;
+    }
+  }
+  fclose(f);
+  return self;
+}
+
+/* Called when the first contained job is started. */
+static void cginit(void) {
+  char *base, shell[PATH_MAX], pid[16];
+
+  cginitdone = true;
+  if ((base = cgself()) == NULL) {
+    msg("limit: cgroup v2 not found, jobs run without limits\n");
+    return;
+  }
+
+  snprintf(shell, sizeof(shell), "%s/shell", base);
+  snprintf(pid, sizeof(pid), "%d", getpid());
+  if ((mkdir(shell, 0755) < 0 && errno != EEXIST) ||
+      !cgwrite(shell, "cgroup.procs", pid)) {
+    msg("limit: %s: %s, jobs run without limits\n", base, strerror(errno));
+    free(base);
+    return;
+  }
+
+  /* Controllers may be missing, then jobs are contained but not limited. */
+  char enabled[256] = "";
+  (void)cgread(base, "cgroup.subtree_control", enabled, sizeof(enabled));
+  cgcpu = cgwrite(base, "cgroup.subtree_control", "+cpu");
+  cgmem = cgwrite(base, "cgroup.subtree_control", "+memory");
+  cgcpuown = cgcpu && !cghas(enabled, "cpu");
+  cgmemown = cgmem && !cghas(enabled, "memory");
+  if (!cgcpu)
+    msg("limit: cpu controller not available, -c is ignored\n");
+  if (!cgmem)
+    msg("limit: memory controller not available, -m is ignored\n");
+  cgbase = base;
+}
+
+/* Called at exit, after all jobs' cgroups were removed. Moves the shell
+ * back to where it was started and undoes what `cginit` did. Nothing is
+ * undone while another shell shares the "shell" leaf. */
+void cgfini(void) {
+  char shell[PATH_MAX], procs[32], pid[16];
+
+  if (cgbase == NULL)
+    return;
+
+  snprintf(shell, sizeof(shell), "%s/shell", cgbase);
+  snprintf(pid, sizeof(pid), "%d\n", getpid());
+  if (cgread(shell, "cgroup.procs", procs, sizeof(procs)) &&
+      !strcmp(procs, pid)) {
+    /* Processes are not allowed in a cgroup that distributes resources. */
+    if (cgcpuown)
+      (void)cgwrite(cgbase, "cgroup.subtree_control", "-cpu");
+    if (cgmemown)
+      (void)cgwrite(cgbase, "cgroup.subtree_control", "-memory");
+    if (cgwrite(cgbase, "cgroup.procs", pid))
+      (void)rmdir(shell);
+  }
+
+  free(cgbase);
+  cgbase = NULL;
+}
+
+/* Create cgroup for a job. `cpu` is a percentage of a single CPU the job
+ * may use and `mem` is written into memory.max, either may be NULL.
+ * Returns identifier of the cgroup or 0 if the job cannot be contained. */
+int cgcreate(const char *cpu, const char *mem) {
+  char path[PATH_MAX];
+
+  if (!cginitdone)
+    cginit();
+  if (cgbase == NULL)
+    return 0;
+
+  int cg = cgnext++;
+  cgpath(path, sizeof(path), cg);
+  if (mkdir(path, 0755) < 0) {
+    msg("limit: %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  if (cpu && cgcpu) {
+    char max[64];
+    snprintf(max, sizeof(max), "%ld 100000", (long)(atof(cpu) * 1000));
+    if (!cgwrite(path, "cpu.max", max))
+      msg("limit: cpu.max: %s\n", strerror(errno));
+  }
+  if (mem && cgmem && !cgwrite(path, "memory.max", mem))
+    msg("limit: memory.max: %s\n", strerror(errno));
+  return cg;
+}
+
+/* Open job's cgroup for starting processes in it with clone3(2).
+ * Returns -1 if it cannot be opened. */
+int cgopen(int cg) {
+  char path[PATH_MAX];
+
+  cgpath(path, sizeof(path), cg);
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    msg("limit: %s: %s\n", path, strerror(errno));
+  return fd;
+}
+
+/* Kill all processes in the cgroup, including those that left job's
+ * process group. Returns false if cgroup.kill is not supported. */
+bool cgkill(int cg) {
+  char path[PATH_MAX];
+  cgpath(path, sizeof(path), cg);
+  return cgwrite(path, "cgroup.kill", "1");
+}
+
+/* Called when job is deleted. Processes that escaped the job and are still
+ * running keep the cgroup alive, so they are killed first. */
+void cgremove(int cg) {
+  char path[PATH_MAX];
+  cgpath(path, sizeof(path), cg);
+  if (rmdir(path) < 0 && errno == EBUSY) {
+    (void)cgkill(cg);
+    (void)rmdir(path);
+  }
+}
+
+/* Live resource usage of all processes in the cgroup. */
+const char *cgusage(int cg) {
+  static char buf[128];
+  char path[PATH_MAX], line[64];
+  size_t n = 0;
+
+  cgpath(path, sizeof(path), cg);
+  buf[0] = '\0';
+
+  /* First line of cpu.stat is usage_usec. */
+  if (cgread(path, "cpu.stat", line, sizeof(line)) &&
+      !strncmp(line, "usage_usec ", 11)) {
+    long usec = atol(line + 11);
+    n += snprintf(buf + n, sizeof(buf) - n, " cgroup cpu %ld.%03lds",
+                  usec / 1000000, usec / 1000 % 1000);
+  }
+  if (cgread(path, "memory.current", line, sizeof(line)))
+    n += snprintf(buf + n, sizeof(buf) - n, "%s mem %ldkB",
+                  n ? "," : " cgroup", atol(line) / 1024);
+  return buf;
+}
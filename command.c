@@ -31,12 +31,359 @@ static int do_chdir(char **argv) {
 
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -l' also shows resources used by each job
  */
 static int do_jobs(char **argv) {
-  watchjobs(ALL);
+  bool verbose = argv[0] && !strcmp(argv[0], "-l");
+  watchjobs(ALL, verbose);
   return 0;
 }
 
+/*
+ * Displays time spent in phases of command execution.
+ * 'stats -r' resets all counters
+ */
+static int do_stats(char **argv) {
+  if (argv[0] && !strcmp(argv[0], "-r"))
+    resetstats();
+  else
+    showstats();
+  return 0;
+}
+
+/*
+ * Displays persistent command history.
+ * 'history' shows last 16 commands
+ * 'history n' shows last n commands
+ * 'history -s text [n]' shows last 16 (or n) commands containing text
+ */
+static int do_history(char **argv) {
+  size_t n = 16;
+  bool search = argv[0] && !strcmp(argv[0], "-s");
+
+  if (search && argv[1] == NULL) {
+    msg("history: -s requires an argument\n");
+    return 1;
+  }
+  if (argv[0] && argv[search ? 2 : 0])
+    n = strtoul(argv[search ? 2 : 0], NULL, 10);
+
+  if (search)
+    histsearch(argv[1], n);
+  else
+    histlist(n);
+  return 0;
+}
+
+/*
+ * Lists commands found in $PATH that complete given prefix.
+ * 'compgen' shows all commands
+ * 'compgen prefix' shows commands starting with prefix
+ */
+static int do_compgen(char **argv) {
+  size_t count;
+  char **names = complete(argv[0] ? argv[0] : "", &count);
+
+  for (size_t i = 0; i < count; i++)
+    printf("%s\n", names[i]);
+  return count ? 0 : 1;
+}
+
+/*
+ * Utilities that are also available as programs in $PATH. Running them
+ * within the shell saves creating a process, which dominates their cost.
+ */
+
+static int do_true(char **argv) {
+  return 0;
+}
+
+static int do_false(char **argv) {
+  return 1;
+}
+
+/* Returns true if the only argument asks for the program's help or version,
+ * which the builtin leaves to the program. */
+static bool helparg_p(char **argv) {
+  return argv[0] && !argv[1] &&
+         (!strcmp(argv[0], "--help") || !strcmp(argv[0], "--version"));
+}
+
+/*
+ * Print arguments separated by spaces.
+ * 'echo -n ...' does not output the trailing newline
+ * Options -e and -E are left to the echo program.
+ */
+static int do_echo(char **argv) {
+  bool newline = true;
+
+  if (helparg_p(argv))
+    return -1;
+  /* Like coreutils, accept options such as "-n -n" or "-nn". */
+  for (; argv[0] && argv[0][0] == '-' && argv[0][1] &&
+         argv[0][1 + strspn(argv[0] + 1, "neE")] == '\0';
+       argv++) {
+    if (argv[0][1 + strspn(argv[0] + 1, "n")] != '\0')
+      return -1;
+    newline = false;
+  }
+  for (int i = 0; argv[i]; i++)
+    printf(i ? " %s" : "%s", argv[i]);
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+
+/* Print the character denoted by escape sequence at `*sp` (just after
+ * a backslash) and advance the pointer past it. */
+static void print_escape(const char **sp) {
+  static const char escapes[] = "\\\\\"\"a\ab\be\033f\fn\nr\rt\tv\v";
+  const char *s = *sp;
+  const char *e;
+
+  if (*s >= '0' && *s <= '7') {
+    int c = 0;
+    for (int k = 0; k < 3 && *s >= '0' && *s <= '7'; k++)
+      c = c * 8 + *s++ - '0';
+    putchar(c);
+  } else if (*s && (e = strchr(escapes, *s)) && (e - escapes) % 2 == 0) {
+    putchar(e[1]);
+    s++;
+  } else {
+    putchar('\\');
+  }
+  *sp = s;
+}
+
+static long long numarg(const char *arg, int *rcp) {
+  char *end;
+  errno = 0;
+  long long v = strtoll(arg, &end, 0);
+  if (*arg == '\0' || *end != '\0' || errno) {
+    msg("printf: %s: invalid number\n", arg);
+    *rcp = 1;
+  }
+  return v;
+}
+
+#define SPECLEN 32 /* room for a conversion with its flags */
+
+/* Returns true if the builtin implements all conversions and escapes used
+ * in `fmt`. Otherwise the printf program is run instead. */
+static bool printf_supported(const char *fmt) {
+  for (const char *s = fmt; *s; s++) {
+    if (*s == '\\') {
+      if (s[1] && strchr("cxuU", s[1]))
+        return false;
+      if (s[1])
+        s++;
+    } else if (*s == '%') {
+      size_t len = strspn(s + 1, "-+ #0123456789.");
+      s += len + 1;
+      if (len == 0 && *s == '%')
+        continue;
+      if (len > SPECLEN - 4 || *s == '\0' || !strchr("scdiouxX", *s))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* Output `fmt` once, consuming arguments for its conversions. */
+static int printf_once(const char *fmt, char ***argp) {
+  int rc = 0;
+
+  for (const char *s = fmt; *s;) {
+    if (*s == '\\') {
+      s++;
+      print_escape(&s);
+      continue;
+    }
+    if (*s != '%' || s[1] == '%') {
+      putchar(*s);
+      s += (*s == '%') ? 2 : 1;
+      continue;
+    }
+
+    /* Copy flags, width and precision, then append the conversion. */
+    char spec[SPECLEN] = "%";
+    size_t len = strspn(s + 1, "-+ #0123456789.");
+    memcpy(spec + 1, s + 1, len);
+    s += len + 1;
+
+    char c = *s++;
+    const char *arg = **argp ? *(*argp)++ : NULL;
+    if (c == 's') {
+      strcat(spec, "s");
+      printf(spec, arg ? arg : "");
+    } else if (c == 'c') {
+      strcat(spec, "c");
+      if (arg && arg[0])
+        printf(spec, arg[0]);
+    } else {
+      strcat(spec, "ll");
+      strncat(spec, &c, 1);
+      printf(spec, arg ? numarg(arg, &rc) : 0LL);
+    }
+  }
+
+  return rc;
+}
+
+/*
+ * Formatted output.
+ * 'printf format [args...]' - format is reused until all args are consumed
+ * Formats using conversions other than %s, %c and integer ones, e.g. %f,
+ * are left to the printf program.
+ */
+static int do_printf(char **argv) {
+  int rc = 0;
+
+  if (argv[0] == NULL) {
+    msg("printf: missing format\n");
+    return 2;
+  }
+  if (helparg_p(argv) || !printf_supported(argv[0]))
+    return -1;
+
+  char **arg = &argv[1];
+  char **last;
+  do {
+    last = arg;
+    rc |= printf_once(argv[0], &arg);
+  } while (*arg && arg != last);
+  return rc;
+}
+
+/* Returns 0 if true, 1 if false, 2 on error, like the utility itself. */
+static int test_unary(const char *op, const char *arg) {
+  struct stat sb;
+
+  if (!strcmp(op, "-n"))
+    return *arg == '\0';
+  if (!strcmp(op, "-z"))
+    return *arg != '\0';
+  if (!strcmp(op, "-t"))
+    return !isatty(atoi(arg));
+  if (!strcmp(op, "-r"))
+    return access(arg, R_OK) < 0;
+  if (!strcmp(op, "-w"))
+    return access(arg, W_OK) < 0;
+  if (!strcmp(op, "-x"))
+    return access(arg, X_OK) < 0;
+  if (!strcmp(op, "-L") || !strcmp(op, "-h"))
+    return lstat(arg, &sb) < 0 || !S_ISLNK(sb.st_mode);
+
+  if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' ||
+      !strchr("edfs", op[1])) {
+    msg("test: %s: unary operator expected\n", op);
+    return 2;
+  }
+  if (stat(arg, &sb) < 0)
+    return 1;
+  switch (op[1]) {
+    case 'd':
+      return !S_ISDIR(sb.st_mode);
+    case 'f':
+      return !S_ISREG(sb.st_mode);
+    case 's':
+      return sb.st_size == 0;
+    default:
+      return 0;
+  }
+}
+
+static bool binary_p(const char *op) {
+  static const char *ops[] = {"=",   "!=",  "-eq", "-ne", "-lt",
+                              "-le", "-gt", "-ge", NULL};
+  for (int i = 0; ops[i]; i++)
+    if (!strcmp(op, ops[i]))
+      return true;
+  return false;
+}
+
+static int test_binary(const char *lhs, const char *op, const char *rhs) {
+  if (!strcmp(op, "="))
+    return strcmp(lhs, rhs) != 0;
+  if (!strcmp(op, "!="))
+    return strcmp(lhs, rhs) == 0;
+
+  long long v[2];
+  const char *arg[2] = {lhs, rhs};
+  for (int i = 0; i < 2; i++) {
+    char *end;
+    errno = 0;
+    v[i] = strtoll(arg[i], &end, 10);
+    if (*arg[i] == '\0' || *end != '\0' || errno) {
+      msg("test: %s: integer expression expected\n", arg[i]);
+      return 2;
+    }
+  }
+
+  static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  bool cmp[] = {v[0] == v[1], v[0] != v[1], v[0] < v[1],
+                v[0] <= v[1], v[0] > v[1],  v[0] >= v[1]};
+  for (int i = 0; i < 6; i++)
+    if (!strcmp(op, ops[i]))
+      return !cmp[i];
+  return 2;
+}
+
+/* Evaluate expression according to the number of arguments, as POSIX
+ * specifies for up to four arguments. */
+static int test_expr(int argc, char **argv) {
+  int rc;
+
+  switch (argc) {
+    case 0:
+      return 1;
+    case 1:
+      return *argv[0] == '\0';
+    case 2:
+      if (!strcmp(argv[0], "!"))
+        return !test_expr(1, argv + 1);
+      return test_unary(argv[0], argv[1]);
+    case 3:
+      if (binary_p(argv[1]))
+        return test_binary(argv[0], argv[1], argv[2]);
+      if (!strcmp(argv[0], "!"))
+        return (rc = test_expr(2, argv + 1)) == 2 ? rc : !rc;
+      if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")"))
+        return test_expr(1, argv + 1);
+      msg("test: %s: binary operator expected\n", argv[1]);
+      return 2;
+    case 4:
+      if (!strcmp(argv[0], "!"))
+        return (rc = test_expr(3, argv + 1)) == 2 ? rc : !rc;
+      break;
+  }
+
+  msg("test: too many arguments\n");
+  return 2;
+}
+
+/*
+ * Evaluate conditional expression.
+ * 'test expr' or '[ expr ]'
+ */
+static int do_test(char **argv) {
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+  return test_expr(argc, argv);
+}
+
+static int do_bracket(char **argv) {
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+  if (argc == 0 || strcmp(argv[argc - 1], "]")) {
+    msg("[: missing ']'\n");
+    return 2;
+  }
+  return test_expr(argc - 1, argv);
+}
+
 /*
  * Move running or stopped background job to foreground.
  * 'fg' choose highest numbered job
@@ -45,11 +392,8 @@ static int do_jobs(char **argv) {
 static int do_fg(char **argv) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, FG, &mask))
+  if (!resumejob(j, FG))
     msg("fg: job not found: %s\n", argv[0]);
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
@@ -61,11 +405,8 @@ static int do_fg(char **argv) {
 static int do_bg(char **argv) {
   int j = argv[0] ? atoi(argv[0]) : -1;
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-  if (!resumejob(j, BG, &mask))
+  if (!resumejob(j, BG))
     msg("bg: job not found: %s\n", argv[0]);
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return 0;
 }
 
@@ -82,26 +423,66 @@ static int do_kill(char **argv) {
 
   int j = atoi(argv[0] + 1);
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
   if (!killjob(j))
     msg("kill: job not found: %s\n", argv[0]);
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
 
   return 0;
 }
 
+/*
+ * Remember or display locations of commands.
+ * 'hash' - list remembered commands
+ * 'hash -r' - forget all remembered locations
+ * 'hash name...' - look up commands and remember their locations
+ */
+static int do_hash(char **argv) {
+  if (argv[0] == NULL) {
+    hashlist();
+    return 0;
+  }
+
+  if (!strcmp(argv[0], "-r")) {
+    hashclear();
+    return 0;
+  }
+
+  int rc = 0;
+  for (; *argv; argv++) {
+    if (index(*argv, '/'))
+      continue;
+    if (!hashcmd(*argv)) {
+      msg("hash: %s: not found\n", *argv);
+      rc = 1;
+    }
+  }
+  return rc;
+}
+
 static command_t builtins[] = {
-  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs}, {"fg", do_fg},
-  {"bg", do_bg},     {"kill", do_kill}, {NULL, NULL},
+  {"quit", do_quit}, {"cd", do_chdir},  {"jobs", do_jobs},   {"fg", do_fg},
+  {"bg", do_bg},     {"kill", do_kill}, {"hash", do_hash},   {"stats", do_stats},
+  {"history", do_history}, {"compgen", do_compgen},
+  {"true", do_true},       {"false", do_false},     {"echo", do_echo},
+  {"printf", do_printf},   {"test", do_test},       {"[", do_bracket},
+  {NULL, NULL},
 };
 
+static command_t *find_builtin(const char *name) {
+  for (command_t *cmd = builtins; cmd->name; cmd++)
+    if (!strcmp(name, cmd->name))
+      return cmd;
+  return NULL;
+}
+
+/* Returns true if `name` may be executed within the shell's process. */
+bool builtin_p(const char *name) {
+  return find_builtin(name) != NULL;
+}
+
 int builtin_command(char **argv) {
-  for (command_t *cmd = builtins; cmd->name; cmd++) {
-    if (strcmp(argv[0], cmd->name))
-      continue;
+  command_t *cmd = find_builtin(argv[0]);
+  if (cmd)
     return cmd->func(&argv[1]);
-  }
 
   errno = ENOENT;
   return -1;
@@ -113,29 +494,19 @@ noreturn void external_command(char **argv) {
   if (!index(argv[0], '/') && path) {
     /* TODO: For all paths in PATH construct an absolute path and execve it. */
 #ifdef STUDENT
-    const char *curr = path;
-    // we copy our path
-    while (*curr) {
-      // go token by token
-      size_t len = strcspn(curr, ":");
-      // take the length of first part separated with ':'
-      char *part = strndup(curr, len);
-      // and copy the part
-      char *full_path = NULL;
-      strapp(&full_path, part);
-      strapp(&full_path, "/");
-      strapp(&full_path, argv[0]);
-      // we add the command to the path
+    // the shell looked the command up before forking, so it's usually
+    // already in the hash table inherited from the parent
+    const char *full_path = hashcmd(argv[0]);
+    if (full_path) {
       (void)execve(full_path, argv, environ);
-      // and execute
-      free(full_path);
-      // freeing the memory
-      free(part);
-      curr += len;
-      if (*curr == ':') {
-        // skipping all the chars until ':'
-        curr++;
+      if (errno == ENOENT) {
+        // remembered location is stale, search the PATH once more
+        hashdel(argv[0]);
+        if ((full_path = hashcmd(argv[0])))
+          (void)execve(full_path, argv, environ);
       }
+    } else {
+      errno = ENOENT;
     }
 #endif /* !STUDENT */
   } else {
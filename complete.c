@@ -0,0 +1,242 @@
+#include <dirent.h>
+#include "shell.h"
+
+/* Command completion: sorted index of executables found in directories
+ * listed in $PATH. Each directory is read with getdents(2) in large chunks
+ * and its entries are kept until the directory's mtime changes, which is
+ * what happens when a file is added, removed or renamed there. Listings of
+ * all directories are merged into a single sorted array, so a prefix query
+ * is a binary search followed by a scan over the matches. Regular files are
+ * checked to be executable only when they match a query. */
+
+typedef struct {
+  char *name;
+  size_t dir; /* position of the directory in $PATH */
+  bool exec;  /* known to be executable */
+} compent_t;
+
+typedef struct {
+  char *path;            /* directory as listed in $PATH */
+  struct timespec mtime; /* modification time when the listing was read */
+  dev_t dev;             /* identity of the directory that was read */
+  ino_t ino;
+  compent_t *ents;       /* files that may be executables */
+  size_t nents;
+  bool valid;            /* listing reflects contents of the directory */
+} compdir_t;
+
+static compdir_t *compdirs = NULL;
+static size_t ncompdirs = 0;
+static char *indexed_path = NULL; /* value of $PATH the index was built for */
+static compent_t **compindex = NULL; /* entries from all directories */
+static size_t nindex = 0;
+static char **compmatches = NULL;    /* result of the last query */
+
+/* Order by name, then by position of the directory in $PATH. */
+static int entcmp(const void *a, const void *b) {
+  const compent_t *ea = *(compent_t *const *)a;
+  const compent_t *eb = *(compent_t *const *)b;
+  int cmp = strcmp(ea->name, eb->name);
+  if (cmp)
+    return cmp;
+  return (ea->dir > eb->dir) - (ea->dir < eb->dir);
+}
+
+static void compdir_clear(compdir_t *cd) {
+  for (size_t i = 0; i < cd->nents; i++)
+    free(cd->ents[i].name);
+  free(cd->ents);
+  cd->ents = NULL;
+  cd->nents = 0;
+}
+
+/* Read the list of executables in the directory. A few large reads are much
+ * cheaper than what readdir(3) does, especially over NFS. Regular files are
+ * not stat(2)ed here, as directories in $PATH seldom hold anything but
+ * executables; complete() checks the few that match a prefix. */
+static void compdir_read(compdir_t *cd, int dirfd) {
+  char buf[32768] __attribute__((aligned(8)));
+  struct linux_dirent *dirp = (struct linux_dirent *)buf;
+  size_t size = 0;
+  int n;
+
+  compdir_clear(cd);
+
+  while ((n = Getdents(dirfd, dirp, sizeof(buf))) > 0) {
+    for (int pos = 0; pos < n;) {
+      struct linux_dirent *d = (struct linux_dirent *)(buf + pos);
+      int type = buf[pos + d->d_reclen - 1];
+      pos += d->d_reclen;
+
+      if (d->d_name[0] == '.' || (type != DT_REG && type != DT_LNK &&
+                                  type != DT_UNKNOWN))
+        continue;
+
+      /* Type of symbolic link target or of the entry itself is not known. */
+      struct stat sb;
+      if (type != DT_REG &&
+          (fstatat(dirfd, d->d_name, &sb, 0) < 0 || !S_ISREG(sb.st_mode) ||
+           !(sb.st_mode & 0111)))
+        continue;
+
+      if (cd->nents == size) {
+        size = size ? size * 2 : 64;
+        cd->ents = Realloc(cd->ents, size * sizeof(compent_t));
+      }
+      cd->ents[cd->nents++] = (compent_t){
+        .name = strdup(d->d_name),
+        .dir = cd - compdirs,
+        .exec = type != DT_REG,
+      };
+    }
+  }
+}
+
+/* Re-read the directory if it changed since it was last read, which costs
+ * a single stat(2) if it did not. Unreadable directories are treated as
+ * empty. Returns true if listing of the directory was updated. */
+static bool compdir_check(compdir_t *cd) {
+  struct stat sb;
+  int dirfd = -1;
+
+  if (stat(cd->path, &sb) == 0 && cd->valid && cd->dev == sb.st_dev &&
+      cd->ino == sb.st_ino && cd->mtime.tv_sec == sb.st_mtim.tv_sec &&
+      cd->mtime.tv_nsec == sb.st_mtim.tv_nsec)
+    return false;
+
+  /* Directory could have been replaced in the meantime, so take its
+   * identity from the descriptor that is actually read. */
+  if ((dirfd = open(cd->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+      fstat(dirfd, &sb) < 0) {
+    if (dirfd >= 0)
+      Close(dirfd);
+    bool changed = cd->valid;
+    compdir_clear(cd);
+    cd->valid = false;
+    return changed;
+  }
+
+  compdir_read(cd, dirfd);
+  Close(dirfd);
+  cd->dev = sb.st_dev;
+  cd->ino = sb.st_ino;
+  cd->mtime = sb.st_mtim;
+  cd->valid = true;
+  return true;
+}
+
+/* Split $PATH into directories. Previous listings are dropped. */
+static void compdirs_reset(const char *path) {
+  for (size_t i = 0; i < ncompdirs; i++) {
+    compdir_clear(&compdirs[i]);
+    free(compdirs[i].path);
+  }
+  free(compdirs);
+  compdirs = NULL;
+  ncompdirs = 0;
+
+  free(indexed_path);
+  indexed_path = strdup(path);
+
+  for (const char *p = path;; p++) {
+    size_t len = strcspn(p, ":");
+    compdirs = Realloc(compdirs, (ncompdirs + 1) * sizeof(compdir_t));
+    compdirs[ncompdirs++] = (compdir_t){
+      /* Empty entry in $PATH stands for current working directory. */
+      .path = len ? strndup(p, len) : strdup("."),
+    };
+    p += len;
+    if (*p == '\0')
+      break;
+  }
+}
+
+/* Merge listings of all directories. A name present in many directories
+ * is kept for each of them, as the first one may turn out not to be
+ * executable. */
+static void compindex_build(void) {
+  size_t total = 0;
+  for (size_t i = 0; i < ncompdirs; i++)
+    total += compdirs[i].nents;
+
+  compindex = Realloc(compindex, max(total, 1) * sizeof(compent_t *));
+  compmatches = Realloc(compmatches, max(total, 1) * sizeof(char *));
+  nindex = 0;
+  for (size_t i = 0; i < ncompdirs; i++)
+    for (size_t j = 0; j < compdirs[i].nents; j++)
+      compindex[nindex++] = &compdirs[i].ents[j];
+
+  qsort(compindex, nindex, sizeof(compent_t *), entcmp);
+}
+
+/* Check that the entry is an executable, as hashcmd() would. Positive
+ * answers are remembered until the directory is read again. Negative ones
+ * are not, so a `chmod +x` is noticed, but such files are rare in $PATH. */
+static bool compent_exec(compent_t *ce) {
+  char path[PATH_MAX];
+  struct stat sb;
+
+  if (!ce->exec &&
+      snprintf(path, sizeof(path), "%s/%s", compdirs[ce->dir].path,
+               ce->name) < (int)sizeof(path) &&
+      stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && (sb.st_mode & 0111))
+    ce->exec = true;
+  return ce->exec;
+}
+
+/* Bring the index up to date with $PATH and contents of its directories. */
+static void compindex_check(void) {
+  const char *path = getenv("PATH");
+  bool changed = false;
+
+  if (path == NULL)
+    path = "";
+
+  if (indexed_path == NULL || strcmp(indexed_path, path)) {
+    compdirs_reset(path);
+    changed = true;
+  }
+
+  for (size_t i = 0; i < ncompdirs; i++)
+    changed |= compdir_check(&compdirs[i]);
+
+  if (changed)
+    compindex_build();
+}
+
+/* Find the first name not less than `prefix`. */
+static size_t lower_bound(const char *prefix) {
+  size_t lo = 0, hi = nindex;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(compindex[mid]->name, prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Returns command names starting with `prefix` in alphabetical order.
+ * Stores number of matches in `*countp`. The array is owned by the index
+ * and remains valid until the next call. */
+char **complete(const char *prefix, size_t *countp) {
+  size_t len = strlen(prefix);
+
+  uint64_t start = phasestart();
+  compindex_check();
+  size_t count = 0;
+  for (size_t i = lower_bound(prefix);
+       i < nindex && !strncmp(compindex[i]->name, prefix, len); i++) {
+    compent_t *ce = compindex[i];
+    /* Only the first executable of that name is run, so list it once. */
+    if (count > 0 && !strcmp(compmatches[count - 1], ce->name))
+      continue;
+    if (compent_exec(ce))
+      compmatches[count++] = ce->name;
+  }
+  phaseend(PH_COMPLETE, start);
+
+  *countp = count;
+  return compmatches;
+}
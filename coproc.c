@@ -0,0 +1,134 @@
+#include "shell.h"
+
+/* Coprocesses: background jobs connected to the shell with a socketpair(2).
+ * The job's standard input and output are its end of the socket, the shell
+ * keeps the other end under the coprocess name, so that later commands can
+ * talk to the job with `>&NAME` and `<&NAME` redirections. A stream socket
+ * is bidirectional, hence a single descriptor serves both ways. The shell's
+ * end is closed once the job is deleted, i.e. after its exit was reported,
+ * unless there's output left to read. Then it stays around until another
+ * coprocess takes the name.
+ * Since the shell's end stays open, a job reading till the end of input is
+ * told there's nothing more with `>&NAME-`, which shuts the socket down for
+ * writing once the command that has it as output is done. */
+
+typedef struct coproc {
+  char *name;          /* name used in redirections */
+  pid_t pgid;          /* process group of the job or 0 if not started yet */
+  pid_t writer;        /* shut down for writing once this job is deleted */
+  bool done;           /* job was deleted, but its output was not read */
+  int fd;              /* shell's end of the socket */
+  struct coproc *next; /* next coprocess on the list */
+} coproc_t;
+
+static coproc_t *coprocs = NULL;
+
+/* Looks up coprocess named by the first `len` characters of `name`. */
+static coproc_t **coproclookup(const char *name, size_t len) {
+  coproc_t **cpp = &coprocs;
+  while (*cpp && (strncmp((*cpp)->name, name, len) || (*cpp)->name[len]))
+    cpp = &(*cpp)->next;
+  return cpp;
+}
+
+static void coprocfree(coproc_t **cpp) {
+  coproc_t *cp = *cpp;
+  *cpp = cp->next;
+  Close(cp->fd);
+  free(cp->name);
+  free(cp);
+}
+
+/* Name must be an identifier, so that it cannot be mistaken for a
+ * descriptor number in a redirection. */
+bool coprocname_p(const char *name) {
+  if (!isalpha((unsigned char)name[0]) && name[0] != '_')
+    return false;
+  for (const char *s = name; *s; s++)
+    if (!isalnum((unsigned char)*s) && *s != '_')
+      return false;
+  return true;
+}
+
+/* Shell's end of the socket connected to coprocess `name` or -1. */
+int coprocfd(const char *name) {
+  coproc_t *cp = *coproclookup(name, strlen(name));
+  return cp ? cp->fd : -1;
+}
+
+/* Same as `coprocfd`, but `arg` is a name followed by '-'. */
+int coprocshutfd(const char *arg) {
+  size_t len = strlen(arg);
+  if (len < 2 || arg[len - 1] != '-')
+    return -1;
+  coproc_t *cp = *coproclookup(arg, len - 1);
+  return cp ? cp->fd : -1;
+}
+
+/* Shut down the channel to coprocess named in `>&NAME-` argument for
+ * writing, right away if `writer` is 0, or once job `writer` is deleted,
+ * since until then its processes may still be writing to the socket. */
+void coprocshut(const char *arg, pid_t writer) {
+  coproc_t *cp = *coproclookup(arg, strlen(arg) - 1);
+  if (cp == NULL)
+    return;
+  if (writer)
+    cp->writer = writer;
+  else
+    (void)shutdown(cp->fd, SHUT_WR);
+}
+
+/* Create a channel for coprocess `name`. Returns the end to become job's
+ * standard input and output, which the shell closes once it started the
+ * job, or -1 if the name is already taken. */
+int coprocopen(const char *name) {
+  int sv[2];
+
+  coproc_t **cpp = coproclookup(name, strlen(name));
+  if (*cpp && (*cpp)->done) {
+    coprocfree(cpp);
+  } else if (*cpp) {
+    msg("coproc: %s: already exists\n", name);
+    return -1;
+  }
+
+  Socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+  coproc_t *cp = Malloc(sizeof(coproc_t));
+  *cp = (coproc_t){
+    .name = strdup(name),
+    .fd = movefd(sv[0]),
+    .next = coprocs,
+  };
+  coprocs = cp;
+  return sv[1];
+}
+
+/* Coprocess `name` runs as a job with process group `pgid`. If the job
+ * could not be started, i.e. `pgid` is 0, the channel is dropped. */
+void coprocstarted(const char *name, pid_t pgid) {
+  coproc_t **cpp = coproclookup(name, strlen(name));
+  if (pgid)
+    (*cpp)->pgid = pgid;
+  else
+    coprocfree(cpp);
+}
+
+/* Called when job with process group `pgid` is deleted. */
+void coprocclose(pid_t pgid) {
+  for (coproc_t **cpp = &coprocs; *cpp;) {
+    if ((*cpp)->writer == pgid) {
+      (void)shutdown((*cpp)->fd, SHUT_WR);
+      (*cpp)->writer = 0;
+    }
+    char c;
+    if ((*cpp)->pgid != pgid) {
+      cpp = &(*cpp)->next;
+    } else if (recv((*cpp)->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+      (*cpp)->pgid = 0;
+      (*cpp)->done = true;
+      cpp = &(*cpp)->next;
+    } else {
+      coprocfree(cpp);
+    }
+  }
+}
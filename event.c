@@ -0,0 +1,194 @@
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "shell.h"
+
+/* Event loop: the only place where the shell sleeps. Signals handled here
+ * (e.g. SIGCHLD) stay blocked and are received through a signalfd, so their
+ * handlers run as ordinary code and may touch any data structure. Timers
+ * are timerfds and file descriptors (e.g. terminal) are watched with epoll. */
+
+enum { EV_FD, EV_TIMER, EV_SIGNAL };
+
+struct event {
+  int kind;      /* EV_FD, EV_TIMER or EV_SIGNAL */
+  int fd;        /* watched descriptor, timerfd or signal number */
+  evfunc_t func; /* NULL if event was cancelled */
+  void *arg;     /* argument passed to func */
+  event_t *next; /* next cancelled event waiting to be freed */
+};
+
+#define MAXEVENTS 16
+
+sigset_t child_mask;              /* signal mask the shell started with */
+static int epoll_fd = -1;         /* all event sources are registered here */
+static int signal_fd = -1;        /* delivers signals from signal_mask */
+static sigset_t signal_mask;      /* signals handled by the event loop */
+static event_t signal_ev;         /* signalfd's own epoll registration */
+static event_t *signals[NSIG];    /* handlers of signals */
+static event_t *cancelled = NULL; /* events to be freed after dispatch */
+
+static event_t *evalloc(int kind, int fd, evfunc_t func, void *arg) {
+  event_t *ev = Malloc(sizeof(event_t));
+  ev->kind = kind;
+  ev->fd = fd;
+  ev->func = func;
+  ev->arg = arg;
+  ev->next = NULL;
+  return ev;
+}
+
+static void evregister(int fd, event_t *ev) {
+  struct epoll_event ee = {.events = EPOLLIN, .data.ptr = ev};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ee) < 0)
+    unix_error("epoll_ctl error");
+}
+
+/* Call `func` each time `fd` becomes readable. */
+event_t *evwatch(int fd, evfunc_t func, void *arg) {
+  event_t *ev = evalloc(EV_FD, fd, func, arg);
+  evregister(fd, ev);
+  return ev;
+}
+
+/* Call `func` once, after `msec` milliseconds have elapsed.
+ * The timer must be released with evcancel, whether it has fired or not. */
+event_t *evtimer(unsigned msec, evfunc_t func, void *arg) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd < 0)
+    unix_error("timerfd_create error");
+
+  struct itimerspec its = {
+    .it_value.tv_sec = msec / 1000,
+    .it_value.tv_nsec = (msec % 1000) * 1000000,
+  };
+  /* Zero would disarm the timer, make it expire as soon as possible. */
+  if (msec == 0)
+    its.it_value.tv_nsec = 1;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    unix_error("timerfd_settime error");
+
+  event_t *ev = evalloc(EV_TIMER, fd, func, arg);
+  evregister(fd, ev);
+  return ev;
+}
+
+/* Call `func` each time signal `sig` is delivered to the shell.
+ * The signal gets blocked, so it can only be received here. */
+event_t *evsignal(int sig, evfunc_t func, void *arg) {
+  assert(signals[sig] == NULL);
+
+  sigaddset(&signal_mask, sig);
+  Sigprocmask(SIG_BLOCK, &signal_mask, NULL);
+  if (signalfd(signal_fd, &signal_mask, 0) < 0)
+    unix_error("signalfd error");
+
+  return signals[sig] = evalloc(EV_SIGNAL, sig, func, arg);
+}
+
+/* Stop delivering the event. Safe to call from within event handlers. */
+void evcancel(event_t *ev) {
+  if (ev == NULL || ev->func == NULL)
+    return;
+
+  if (ev->kind == EV_SIGNAL) {
+    signals[ev->fd] = NULL;
+  } else {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
+    if (ev->kind == EV_TIMER)
+      Close(ev->fd);
+  }
+
+  ev->func = NULL;
+  ev->next = cancelled;
+  cancelled = ev;
+}
+
+static void dispatch_signals(void) {
+  struct signalfd_siginfo si;
+
+  while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+    event_t *ev = signals[si.ssi_signo];
+    if (ev && ev->func)
+      ev->func(ev->arg);
+  }
+}
+
+static void dispatch(event_t *ev) {
+  if (ev == &signal_ev) {
+    dispatch_signals();
+    return;
+  }
+
+  if (ev->func == NULL)
+    return;
+
+  if (ev->kind == EV_TIMER) {
+    uint64_t expirations;
+    if (read(ev->fd, &expirations, sizeof(expirations)) < 0)
+      return;
+  }
+
+  ev->func(ev->arg);
+}
+
+/* Wait for events for at most `timeout` ms (-1 means forever) and run their
+ * handlers. Returns false if the wait was interrupted by a signal. */
+static bool evrun(int timeout) {
+  struct epoll_event ee[MAXEVENTS];
+  int n = epoll_wait(epoll_fd, ee, MAXEVENTS, timeout);
+
+  if (n < 0) {
+    if (errno != EINTR)
+      unix_error("epoll_wait error");
+    return false;
+  }
+
+  for (int i = 0; i < n; i++)
+    dispatch(ee[i].data.ptr);
+
+  while (cancelled) {
+    event_t *ev = cancelled;
+    cancelled = ev->next;
+    free(ev);
+  }
+
+  return true;
+}
+
+/* Block until at least one event is handled. */
+bool evwait(void) {
+  return evrun(-1);
+}
+
+/* Handle events that are already pending, do not block. */
+void evcheck(void) {
+  (void)evrun(0);
+}
+
+/* Shell's private descriptors are moved out of the way of descriptors
+ * that user may want to redirect. */
+int movefd(int fd) {
+  int newfd = fcntl(fd, F_DUPFD_CLOEXEC, FD_PRIVATE);
+  if (newfd < 0)
+    unix_error("fcntl error");
+  Close(fd);
+  return newfd;
+}
+
+/* Called at the beginning of shell's life, before any events get added. */
+void initevents(void) {
+  Sigprocmask(SIG_BLOCK, NULL, &child_mask);
+  sigemptyset(&signal_mask);
+
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+  epoll_fd = movefd(epoll_fd);
+  signal_fd = signalfd(-1, &signal_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (signal_fd < 0)
+    unix_error("signalfd error");
+  signal_fd = movefd(signal_fd);
+
+  signal_ev = (event_t){.kind = EV_SIGNAL, .fd = signal_fd, .func = NULL};
+  evregister(signal_fd, &signal_ev);
+}
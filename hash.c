@@ -0,0 +1,150 @@
+#include "shell.h"
+
+/* Command hash table: maps command names to absolute paths of executables
+ * found while searching directories listed in $PATH. Entries are filled in
+ * by the shell process before it spawns a subprocess, so children inherit
+ * a warm table and execve the right file on the first attempt. */
+
+typedef struct hashent {
+  struct hashent *next; /* next entry in the same bucket */
+  uint32_t hash;        /* jenkins_hash of the name */
+  int hits;             /* how many times the entry was used */
+  char *name;           /* command name as typed by the user */
+  char *path;           /* absolute path of the executable */
+} hashent_t;
+
+#define NBUCKETS 64 /* must be a power of two */
+
+static hashent_t *buckets[NBUCKETS];
+static char *hashed_path = NULL; /* value of $PATH the table was built for */
+
+/* jenkins_hash reads the key by whole words, i.e. up to three bytes past
+ * its end, which AddressSanitizer rightly reports. Hash a padded copy. */
+static uint32_t namehash(const char *name) {
+  size_t len = strlen(name);
+  uint32_t buf[len / 4 + 1];
+  buf[len / 4] = 0;
+  memcpy(buf, name, len);
+  return jenkins_hash(buf, len, HASHINIT);
+}
+
+static hashent_t **bucket(uint32_t hash) {
+  return &buckets[hash & (NBUCKETS - 1)];
+}
+
+/* Drop all remembered locations. */
+void hashclear(void) {
+  for (int i = 0; i < NBUCKETS; i++) {
+    hashent_t *he = buckets[i];
+    while (he) {
+      hashent_t *next = he->next;
+      free(he->name);
+      free(he->path);
+      free(he);
+      he = next;
+    }
+    buckets[i] = NULL;
+  }
+  free(hashed_path);
+  hashed_path = NULL;
+}
+
+/* Forget location of a single command, e.g. because it was removed. */
+void hashdel(const char *name) {
+  uint32_t hash = namehash(name);
+  for (hashent_t **hep = bucket(hash); *hep; hep = &(*hep)->next) {
+    hashent_t *he = *hep;
+    if (he->hash == hash && !strcmp(he->name, name)) {
+      *hep = he->next;
+      free(he->name);
+      free(he->path);
+      free(he);
+      return;
+    }
+  }
+}
+
+/* Table is only valid for the value of $PATH it was filled with. */
+static void hashcheck(const char *path) {
+  if (hashed_path && !strcmp(hashed_path, path))
+    return;
+  hashclear();
+  hashed_path = strdup(path);
+}
+
+/* Walk directories in $PATH and find first executable named `name`. */
+static char *pathsearch(const char *path, const char *name) {
+  char buf[PATH_MAX];
+  size_t namelen = strlen(name);
+
+  while (*path) {
+    size_t len = strcspn(path, ":");
+    /* Empty entry in $PATH stands for current working directory. */
+    const char *dir = len ? path : ".";
+    size_t dirlen = len ? len : 1;
+
+    if (dirlen + namelen + 2 <= sizeof(buf)) {
+      memcpy(buf, dir, dirlen);
+      buf[dirlen] = '/';
+      memcpy(buf + dirlen + 1, name, namelen + 1);
+
+      struct stat sb;
+      if (stat(buf, &sb) == 0 && S_ISREG(sb.st_mode) && (sb.st_mode & 0111))
+        return strdup(buf);
+    }
+
+    path += len;
+    if (*path == ':')
+      path++;
+  }
+
+  return NULL;
+}
+
+/* Returns absolute path of command `name` or NULL if it cannot be found.
+ * Successful searches are remembered until $PATH changes or `hash -r`. */
+const char *hashcmd(const char *name) {
+  const char *path = getenv("PATH");
+  if (path == NULL)
+    return NULL;
+
+  hashcheck(path);
+
+  uint32_t hash = namehash(name);
+  for (hashent_t *he = *bucket(hash); he; he = he->next) {
+    if (he->hash == hash && !strcmp(he->name, name)) {
+      he->hits++;
+      return he->path;
+    }
+  }
+
+  char *found = pathsearch(path, name);
+  if (found == NULL)
+    return NULL;
+
+  hashent_t *he = malloc(sizeof(hashent_t));
+  he->hash = hash;
+  he->hits = 1;
+  he->name = strdup(name);
+  he->path = found;
+  he->next = *bucket(hash);
+  *bucket(hash) = he;
+  return he->path;
+}
+
+/* Print remembered locations in a format similar to bash's `hash`. */
+void hashlist(void) {
+  bool empty = true;
+
+  for (int i = 0; i < NBUCKETS; i++) {
+    for (hashent_t *he = buckets[i]; he; he = he->next) {
+      if (empty)
+        printf("hits\tcommand\n");
+      printf("%4d\t%s\n", he->hits, he->path);
+      empty = false;
+    }
+  }
+
+  if (empty)
+    printf("hash: hash table empty\n");
+}
@@ -0,0 +1,259 @@
+#include <sys/file.h>
+#include "shell.h"
+
+/* GNU extension that <string.h> only declares with _GNU_SOURCE. */
+void *memmem(const void *haystack, size_t haystacklen, const void *needle,
+             size_t needlelen);
+
+/* Persistent command history kept in two append-only files:
+ *  - $HISTFILE (by default ~/.shell_history) holds lines separated by '\n',
+ *  - $HISTFILE.idx holds a fixed-size record for each line.
+ * Both are memory-mapped and nothing is parsed at startup: the index gives
+ * location of n-th entry in constant time, so reverse search merely walks
+ * the index backwards. Concurrent shells append under an exclusive flock
+ * on the index file, readers never lock and only look at complete records.
+ * If a shell died between writing a line and its index record, the missing
+ * records are rebuilt from the unindexed tail of the data file. */
+
+typedef struct {
+  uint64_t offset; /* position of the line in data file */
+  uint32_t length; /* length of the line without '\n' */
+  uint32_t time;   /* when the line was entered */
+} histent_t;
+
+typedef struct {
+  int fd;        /* file descriptor or -1 */
+  char *map;     /* mapped contents or NULL */
+  size_t mapped; /* size of the mapping */
+} histfile_t;
+
+static histfile_t histdata = {.fd = -1}, histidx = {.fd = -1};
+
+/* Open history file and place its descriptor out of the way of redirections
+ * and subprocesses. */
+static int histopen(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  return (fd < 0) ? fd : movefd(fd);
+}
+
+/* Called at startup. History is disabled if files cannot be opened. */
+void inithistory(void) {
+  const char *path = getenv("HISTFILE");
+  char buf[PATH_MAX];
+
+  if (path == NULL) {
+    const char *home = getenv("HOME");
+    if (home == NULL)
+      return;
+    if (snprintf(buf, sizeof(buf), "%s/.shell_history", home) >= PATH_MAX)
+      goto toolong;
+    path = buf;
+  }
+
+  char idxpath[PATH_MAX];
+  if (snprintf(idxpath, sizeof(idxpath), "%s.idx", path) >= PATH_MAX)
+    goto toolong;
+
+  histdata.fd = histopen(path);
+  if (histdata.fd < 0 || (histidx.fd = histopen(idxpath)) < 0) {
+    msg("history: %s: %s\n", path, strerror(errno));
+    if (histdata.fd >= 0)
+      Close(histdata.fd);
+    histdata.fd = histidx.fd = -1;
+  }
+  return;
+
+toolong:
+  msg("history: %s: %s\n", path ? path : "$HOME", strerror(ENAMETOOLONG));
+}
+
+/* Make sure the mapping covers the whole file, which other shells could have
+ * extended. Returns current size of the file. */
+static size_t histmap(histfile_t *hf) {
+  struct stat sb;
+
+  Fstat(hf->fd, &sb);
+  if ((size_t)sb.st_size != hf->mapped) {
+    if (hf->map)
+      Munmap(hf->map, hf->mapped);
+    hf->map = NULL;
+    hf->mapped = sb.st_size;
+    if (hf->mapped > 0)
+      hf->map = Mmap(NULL, hf->mapped, PROT_READ, MAP_SHARED, hf->fd, 0);
+  }
+  return hf->mapped;
+}
+
+static size_t histcount(void) {
+  return histmap(&histidx) / sizeof(histent_t);
+}
+
+static histent_t *histent(size_t i) {
+  return &((histent_t *)histidx.map)[i];
+}
+
+/* Index records for lines past the last indexed one. Must be called with the
+ * lock held. Only needed if some shell crashed in the middle of `histadd`. */
+static void histrepair(void) {
+  size_t n = histcount();
+  size_t size = histmap(&histdata);
+  size_t offset = 0;
+
+  if (n > 0)
+    offset = histent(n - 1)->offset + histent(n - 1)->length + 1;
+
+  while (offset < size) {
+    char *nl = memchr(histdata.map + offset, '\n', size - offset);
+    size_t end = nl ? (size_t)(nl - histdata.map) : size;
+    histent_t he = {.offset = offset, .length = end - offset, .time = 0};
+    if (nl == NULL) {
+      /* Terminate the partial line, so the next one starts afresh. */
+      if (write(histdata.fd, "\n", 1) != 1)
+        return;
+    }
+    if (write(histidx.fd, &he, sizeof(he)) != sizeof(he))
+      return;
+    offset = end + 1;
+  }
+}
+
+/* Append a line to the history. */
+void histadd(const char *line) {
+  if (histdata.fd < 0)
+    return;
+
+  size_t len = strlen(line);
+  struct iovec iov[2] = {{(char *)line, len}, {"\n", 1}};
+
+  if (flock(histidx.fd, LOCK_EX) < 0)
+    return;
+
+  histrepair();
+
+  histent_t he = {
+    .offset = histmap(&histdata),
+    .length = len,
+    .time = time(NULL),
+  };
+  if (writev(histdata.fd, iov, 2) == (ssize_t)len + 1) {
+    /* If that fails, the record gets rebuilt by the next `histrepair`. */
+    ssize_t n = write(histidx.fd, &he, sizeof(he));
+    (void)n;
+  }
+
+  flock(histidx.fd, LOCK_UN);
+}
+
+/* Index records and lines are written separately, so a record may refer to
+ * data that is not mapped yet. */
+static const char *histline(size_t i, int *lenp) {
+  histent_t *he = histent(i);
+  uint64_t end = he->offset + he->length;
+  if (end > histdata.mapped && end > histmap(&histdata))
+    return NULL;
+  *lenp = he->length;
+  return histdata.map + he->offset;
+}
+
+/* Print the last `n` entries numbered from the oldest one. */
+void histlist(size_t n) {
+  size_t count;
+
+  if (histdata.fd < 0 || (count = histcount()) == 0)
+    return;
+
+  histmap(&histdata);
+  for (size_t i = (n < count) ? count - n : 0; i < count; i++) {
+    int len;
+    const char *line = histline(i, &len);
+    if (line)
+      printf("%5zu  %.*s\n", i + 1, len, line);
+  }
+}
+
+/* Search index: for every trigram, hashed into one of TRI_NBUCKETS buckets,
+ * an ascending list of entries that contain it. The index is kept in memory
+ * only. It is built by the first search and afterwards extended with entries
+ * appended since, so startup does not pay for it. */
+
+#define TRI_LEN 3
+#define TRI_NBUCKETS 65536
+
+typedef struct {
+  uint32_t *entry; /* entry numbers in ascending order */
+  uint32_t count;  /* number of entries on the list */
+  uint32_t size;   /* capacity of `entry` */
+} posting_t;
+
+static posting_t *trigram = NULL;
+static size_t nindexed = 0; /* entries [0, nindexed) are in the index */
+
+static posting_t *tribucket(const char *s) {
+  return &trigram[jenkins_hash(s, TRI_LEN, 0) & (TRI_NBUCKETS - 1)];
+}
+
+static void histindex(size_t count) {
+  if (trigram == NULL)
+    trigram = Calloc(TRI_NBUCKETS, sizeof(posting_t));
+
+  for (; nindexed < count; nindexed++) {
+    int len;
+    const char *line = histline(nindexed, &len);
+    /* Line not written yet, it will be indexed by a later search. */
+    if (line == NULL)
+      return;
+    for (int j = 0; j + TRI_LEN <= len; j++) {
+      posting_t *p = tribucket(line + j);
+      if (p->count > 0 && p->entry[p->count - 1] == nindexed)
+        continue;
+      if (p->count == p->size) {
+        p->size = p->size ? 2 * p->size : 4;
+        p->entry = Realloc(p->entry, p->size * sizeof(uint32_t));
+      }
+      p->entry[p->count++] = nindexed;
+    }
+  }
+}
+
+/* Print entry `i` if it contains `pattern`. */
+static bool histmatch(size_t i, const char *pattern, size_t plen) {
+  int len;
+  const char *line = histline(i, &len);
+  if (line == NULL || !memmem(line, len, pattern, plen))
+    return false;
+  printf("%5zu  %.*s\n", i + 1, len, line);
+  return true;
+}
+
+/* Reverse search: print at most `n` most recent entries containing
+ * `pattern`, newest first. Only entries on the shortest list among
+ * pattern's trigrams are candidates. Patterns shorter than a trigram
+ * are looked for in every entry. */
+void histsearch(const char *pattern, size_t n) {
+  size_t count, plen = strlen(pattern);
+
+  if (histdata.fd < 0 || (count = histcount()) == 0)
+    return;
+
+  histmap(&histdata);
+
+  if (plen < TRI_LEN) {
+    for (size_t i = count; i > 0 && n > 0; i--)
+      if (histmatch(i - 1, pattern, plen))
+        n--;
+    return;
+  }
+
+  histindex(count);
+
+  posting_t *best = NULL;
+  for (size_t j = 0; j + TRI_LEN <= plen; j++) {
+    posting_t *p = tribucket(pattern + j);
+    if (best == NULL || p->count < best->count)
+      best = p;
+  }
+
+  for (size_t k = best->count; k > 0 && n > 0; k--)
+    if (histmatch(best->entry[k - 1], pattern, plen))
+      n--;
+}
@@ -129,6 +129,7 @@ void Ftruncate(int fd, off_t length);
 int Dup(int fd);
 int Dup2(int oldfd, int newfd);
 void Pipe(int fds[2]);
+void Pipe2(int fds[2], int flags);
 void Socketpair(int domain, int type, int protocol, int sv[2]);
 int Select(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
            struct timeval *timeout);
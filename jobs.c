@@ -1,9 +1,14 @@
+#include <sys/resource.h>
 #include "shell.h"
+#include "bitstring.h"
 
 typedef struct proc {
   pid_t pid;    /* process identifier */
   int state;    /* RUNNING or STOPPED or FINISHED */
-  int exitcode; /* -1 if exit status not yet received */
+  int exitcode; /* last status if stopped or finished, -1 if running */
+  char **argv;  /* arguments, only valid while job is in foreground */
+  struct timeval utime, stime; /* CPU time used, known once finished */
+  long maxrss;                 /* peak resident set size in kilobytes */
 } proc_t;
 
 typedef struct job {
@@ -11,76 +16,173 @@ typedef struct job {
   proc_t *proc;          /* array of processes running in as a job */
   struct termios tmodes; /* saved terminal modes */
   int nproc;             /* number of processes */
+  int nprocmax;          /* number of slots in processes array */
   int state;             /* changes when live processes have same state */
-  char *command;         /* textual representation of command line */
+  int count[3];          /* number of processes in each state */
+  strbuf_t command;      /* textual representation of command line */
+  struct timeval utime, stime; /* CPU time used by finished processes */
+  long maxrss;                 /* largest peak RSS among the processes */
+  struct timespec started;     /* when the job was created */
+  struct timespec finished;    /* when the last process was reaped */
+  event_t *timer;              /* pending timeout of the job or NULL */
+  unsigned killdelay;          /* time [ms] between SIGTERM and SIGKILL */
+  bool timedout;               /* SIGTERM was sent when timer expired */
+  int cgroup;                  /* cgroup containing the job or 0 */
 } job_t;
 
-static job_t *jobs = NULL;          /* array of all jobs */
-static int njobmax = 1;             /* number of slots in jobs array */
-static int tty_fd = -1;             /* controlling terminal file descriptor */
+/* Maps process identifiers to their location in jobs array,
+ * so reapjobs can find a process without scanning all the jobs. */
+typedef struct pident {
+  pid_t pid; /* PID_FREE, PID_DELETED or process identifier */
+  int job;   /* index into jobs array */
+  int proc;  /* index into job's processes array */
+} pident_t;
+
+#define PID_FREE 0
+#define PID_DELETED -1
+
+#define JOBCHUNK 64 /* job slots are allocated in chunks of that size */
+
+static job_t **jobs = NULL;         /* array of all jobs */
+static int njobmax = 0;             /* number of slots in jobs array */
+static bitstr_t *jobused = NULL;    /* bitmap of slots that are taken */
+static pident_t *pidtab = NULL;     /* open addressing hash table */
+static int pidtabsize = 0;          /* number of slots, a power of two */
+static int pidtabused = 0;          /* number of slots not free */
+static int tty_fd = -1;             /* controlling terminal or -1 if none */
 static struct termios shell_tmodes; /* saved shell terminal modes */
 
-static void sigchld_handler(int sig) {
-  int old_errno = errno;
+static unsigned pidhash(pid_t pid) {
+  return jenkins_hash(&pid, sizeof(pid), HASHINIT) & (pidtabsize - 1);
+}
+
+static pident_t *pidlookup(pid_t pid) {
+  if (pidtabsize == 0)
+    return NULL;
+  for (unsigned i = pidhash(pid);; i = (i + 1) & (pidtabsize - 1)) {
+    if (pidtab[i].pid == pid)
+      return &pidtab[i];
+    if (pidtab[i].pid == PID_FREE)
+      return NULL;
+  }
+}
+
+static void pidinsert(pid_t pid, int j, int p);
+
+/* Grow the table, or just get rid of deleted entries. `pidinsert` calls it
+ * once live and deleted entries fill half of the slots. Live entries then
+ * get at most a quarter of the new table, so that the next rehash is at
+ * least as many insertions away as there are live entries. */
+static void pidrehash(void) {
+  pident_t *old = pidtab;
+  int oldsize = pidtabsize;
+  int live = 0;
+
+  for (int i = 0; i < oldsize; i++)
+    if (old[i].pid > 0)
+      live++;
+
+  pidtabsize = max(oldsize, 16);
+  while (4 * (live + 1) > pidtabsize)
+    pidtabsize *= 2;
+  pidtab = calloc(pidtabsize, sizeof(pident_t));
+  pidtabused = 0;
+
+  for (int i = 0; i < oldsize; i++)
+    if (old[i].pid > 0)
+      pidinsert(old[i].pid, old[i].job, old[i].proc);
+  free(old);
+}
+
+static void pidinsert(pid_t pid, int j, int p) {
+  if (2 * (pidtabused + 1) > pidtabsize)
+    pidrehash();
+  unsigned i = pidhash(pid);
+  while (pidtab[i].pid > 0)
+    i = (i + 1) & (pidtabsize - 1);
+  if (pidtab[i].pid == PID_FREE)
+    pidtabused++;
+  pidtab[i] = (pident_t){.pid = pid, .job = j, .proc = p};
+}
+
+static void piddelete(pid_t pid) {
+  pident_t *pe = pidlookup(pid);
+  if (pe)
+    pe->pid = PID_DELETED;
+}
+
+/* Move process from one state to another and update job's state to match.
+ * Runs in constant time, since it only touches per job counters. */
+static void setprocstate(job_t *job, proc_t *proc, int state) {
+  job->count[proc->state]--;
+  job->count[state]++;
+  proc->state = state;
+
+  if (job->count[FINISHED] == job->nproc) {
+    // if all processes are finished, job is finished
+    job->state = FINISHED;
+    // and its process group may be reused, so it must not be signalled
+    evcancel(job->timer);
+    job->timer = NULL;
+  } else if (job->count[STOPPED] > 0) {
+    // if there is a stopped process, the job is
+    // considered as stopped
+    job->state = STOPPED;
+  } else {
+    // same but running
+    job->state = RUNNING;
+  }
+}
+
+/* Resources used by a process that has finished add up to job's usage. */
+static void setprocusage(job_t *job, proc_t *proc, struct rusage *ru) {
+  proc->utime = ru->ru_utime;
+  proc->stime = ru->ru_stime;
+  proc->maxrss = ru->ru_maxrss;
+  timeradd(&job->utime, &proc->utime, &job->utime);
+  timeradd(&job->stime, &proc->stime, &job->stime);
+  job->maxrss = max(job->maxrss, proc->maxrss);
+  if (job->state == FINISHED)
+    clock_gettime(CLOCK_MONOTONIC, &job->finished);
+}
+
+/* Called from the event loop whenever SIGCHLD was delivered to the shell. */
+static void reapjobs(void *arg) {
+  struct rusage ru;
   pid_t pid;
   int status;
   /* TODO: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
    * Bury all children that finished saving their status in jobs. */
 #ifdef STUDENT
-  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-    // basically, we go job by job and check the state of its processes
-    for (int j = 0; j < njobmax; j++) {
-      job_t *job = &jobs[j];
-      if (job->pgid == 0) { // empty job slot
-        continue;
-      }
-      for (int i = 0; i < job->nproc; i++) {
-        // process by process, checking and updating state and exitcode
-        proc_t *proc = &job->proc[i];
-        if (proc->pid == pid) {
-          if (WIFEXITED(status)) {
-            // finished by exiting (ctrl+d)
-            proc->state = FINISHED;
-            proc->exitcode = status;
-          } else if (WIFSIGNALED(status)) {
-            // finished by signal (ctrl+c)
-            proc->state = FINISHED;
-            proc->exitcode = status;
-          } else if (WIFSTOPPED(status)) {
-            // stopped by signal (ctrl+z)
-            proc->state = STOPPED;
-          } else if (WIFCONTINUED(status)) {
-            // resumed by signal (fg command)
-            proc->state = RUNNING;
-          }
-          break;
-        }
-      }
-      int running = 0, stopped = 0, finished = 0;
-      // we count the number of finished, running and stopped
-      // processes in a job
-      for (int i = 0; i < job->nproc; i++) {
-        if (job->proc[i].state == RUNNING) {
-          running++;
-        } else if (job->proc[i].state == STOPPED) {
-          stopped++;
-        } else if (job->proc[i].state == FINISHED) {
-          finished++;
-        }
-      }
-      if (finished == job->nproc)
-        // if all processes are finished, job is finished
-        job->state = FINISHED;
-      else if (stopped > 0)
-        // if there is a stopped process, the job is
-        // considered as stopped
-        job->state = STOPPED;
-      else // same but running
-        job->state = RUNNING;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) >
+         0) {
+    // find the process in the index instead of going job by job
+    pident_t *pe = pidlookup(pid);
+    if (pe == NULL)
+      continue;
+    job_t *job = jobs[pe->job];
+    proc_t *proc = &job->proc[pe->proc];
+    if (WIFEXITED(status)) {
+      // finished by exiting (ctrl+d)
+      proc->exitcode = status;
+      setprocstate(job, proc, FINISHED);
+      setprocusage(job, proc, &ru);
+    } else if (WIFSIGNALED(status)) {
+      // finished by signal (ctrl+c)
+      proc->exitcode = status;
+      setprocstate(job, proc, FINISHED);
+      setprocusage(job, proc, &ru);
+    } else if (WIFSTOPPED(status)) {
+      // stopped by signal (ctrl+z)
+      proc->exitcode = status;
+      setprocstate(job, proc, STOPPED);
+    } else if (WIFCONTINUED(status)) {
+      // resumed by signal (fg command)
+      proc->exitcode = -1;
+      setprocstate(job, proc, RUNNING);
     }
   }
 #endif /* !STUDENT */
-  errno = old_errno;
 }
 
 /* When pipeline is done, its exitcode is fetched from the last process. */
@@ -88,66 +190,111 @@ static int exitcode(job_t *job) {
   return job->proc[job->nproc - 1].exitcode;
 }
 
+/* Add a chunk of free job slots. Jobs never move once allocated,
+ * only the array of pointers to them gets reallocated. */
+static void growjobs(void) {
+  job_t *chunk = Calloc(JOBCHUNK, sizeof(job_t));
+  jobs = Realloc(jobs, sizeof(job_t *) * (njobmax + JOBCHUNK));
+  jobused = Realloc(jobused, bitstr_size(njobmax + JOBCHUNK));
+  bit_nclear(jobused, njobmax, njobmax + JOBCHUNK - 1);
+  for (int i = 0; i < JOBCHUNK; i++)
+    jobs[njobmax + i] = &chunk[i];
+  njobmax += JOBCHUNK;
+}
+
 static int allocjob(void) {
   /* Find empty slot for background job. */
-  for (int j = BG; j < njobmax; j++)
-    if (jobs[j].pgid == 0)
-      return j;
+  int j;
+  bit_ffc(jobused, njobmax, &j);
+
+  /* If none found, allocate new ones. */
+  if (j < 0) {
+    j = njobmax;
+    growjobs();
+  }
+
+  bit_set(jobused, j);
+  return j;
+}
 
-  /* If none found, allocate new one. */
-  jobs = realloc(jobs, sizeof(job_t) * (njobmax + 1));
-  memset(&jobs[njobmax], 0, sizeof(job_t));
-  return njobmax++;
+static void freejob(int j) {
+  if (j != FG)
+    bit_clear(jobused, j);
 }
 
 static int allocproc(int j) {
-  job_t *job = &jobs[j];
-  job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+  job_t *job = jobs[j];
+  assert(job->nproc < job->nprocmax);
   return job->nproc++;
 }
 
-int addjob(pid_t pgid, int bg) {
+/* Number of processes is known from the pipeline plan, so the processes
+ * array is allocated once. Free slots keep their arrays for reuse. */
+int addjob(pid_t pgid, int bg, int nproc) {
   int j = bg ? allocjob() : FG;
-  job_t *job = &jobs[j];
+  job_t *job = jobs[j];
   /* Initial state of a job. */
   job->pgid = pgid;
   job->state = RUNNING;
-  job->command = NULL;
-  job->proc = NULL;
+  sbreset(&job->command);
+  if (job->nprocmax < nproc) {
+    job->proc = Realloc(job->proc, sizeof(proc_t) * nproc);
+    job->nprocmax = nproc;
+  }
   job->nproc = 0;
+  memset(job->count, 0, sizeof(job->count));
   job->tmodes = shell_tmodes;
+  timerclear(&job->utime);
+  timerclear(&job->stime);
+  job->maxrss = 0;
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+  job->timer = NULL;
+  job->timedout = false;
+  job->cgroup = 0;
   return j;
 }
 
-static void deljob(job_t *job) {
+/* Processes array and command buffer stay with the slot for the next job. */
+static void deljob(int j) {
+  job_t *job = jobs[j];
   assert(job->state == FINISHED);
-  free(job->command);
-  free(job->proc);
+  for (int i = 0; i < job->nproc; i++)
+    piddelete(job->proc[i].pid);
+  coprocclose(job->pgid);
   job->pgid = 0;
-  job->command = NULL;
-  job->proc = NULL;
+  sbreset(&job->command);
   job->nproc = 0;
+  if (job->cgroup)
+    cgremove(job->cgroup);
+  job->cgroup = 0;
+  freejob(j);
 }
 
+/* Contents of slots are swapped, so that the free slot `to` gives its spare
+ * processes array and command buffer to slot `from`. */
 static void movejob(int from, int to) {
-  assert(jobs[to].pgid == 0);
-  memcpy(&jobs[to], &jobs[from], sizeof(job_t));
-  memset(&jobs[from], 0, sizeof(job_t));
+  assert(jobs[to]->pgid == 0);
+  job_t tmp = *jobs[to];
+  *jobs[to] = *jobs[from];
+  *jobs[from] = tmp;
+  freejob(from);
+  for (int i = 0; i < jobs[to]->nproc; i++)
+    pidlookup(jobs[to]->proc[i].pid)->job = to;
 }
 
-static void mkcommand(char **cmdp, char **argv) {
-  if (*cmdp)
-    strapp(cmdp, " | ");
+static void mkcommand(strbuf_t *cmd, char **argv) {
+  if (cmd->len > 0)
+    sbappend(cmd, " | ");
 
-  for (strapp(cmdp, *argv++); *argv; argv++) {
-    strapp(cmdp, " ");
-    strapp(cmdp, *argv);
+  for (sbappend(cmd, *argv++); *argv; argv++) {
+    sbappend(cmd, " ");
+    sbappend(cmd, *argv);
   }
 }
 
 void addproc(int j, pid_t pid, char **argv) {
   assert(j < njobmax);
-  job_t *job = &jobs[j];
+  job_t *job = jobs[j];
 
   int p = allocproc(j);
   proc_t *proc = &job->proc[p];
@@ -155,21 +302,28 @@ void addproc(int j, pid_t pid, char **argv) {
   proc->pid = pid;
   proc->state = RUNNING;
   proc->exitcode = -1;
-  mkcommand(&job->command, argv);
+  proc->argv = argv;
+  job->count[RUNNING]++;
+  pidinsert(pid, j, p);
+  /* Arguments of background jobs do not outlive the command line. */
+  if (j != FG) {
+    mkcommand(&job->command, argv);
+    proc->argv = NULL;
+  }
 }
 
 /* Returns job's state.
  * If it's finished, delete it and return exitcode through statusp. */
 static int jobstate(int j, int *statusp) {
   assert(j < njobmax);
-  job_t *job = &jobs[j];
+  job_t *job = jobs[j];
   int state = job->state;
 
   /* TODO: Handle case where job has finished. */
 #ifdef STUDENT
   if (state == FINISHED) {
     *statusp = exitcode(job);
-    deljob(job);
+    deljob(j);
     // if a job is finished, return appropriate exit code and
     // delete from a list
   }
@@ -178,39 +332,47 @@ static int jobstate(int j, int *statusp) {
   return state;
 }
 
+/* Command of a foreground job is rendered only when somebody asks for it. */
 char *jobcmd(int j) {
   assert(j < njobmax);
-  job_t *job = &jobs[j];
-  return job->command;
+  job_t *job = jobs[j];
+  if (job->command.len == 0) {
+    for (int i = 0; i < job->nproc; i++) {
+      mkcommand(&job->command, job->proc[i].argv);
+      job->proc[i].argv = NULL;
+    }
+  }
+  return job->command.data;
 }
 
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
-bool resumejob(int j, int bg, sigset_t *mask) {
+bool resumejob(int j, int bg) {
   if (j < 0) {
-    for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--)
+    for (j = njobmax - 1; j > 0 && jobs[j]->state == FINISHED; j--)
       continue;
   }
 
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j >= njobmax || jobs[j]->state == FINISHED)
     return false;
 
     /* TODO: Continue stopped job. Possibly move job to foreground slot. */
 #ifdef STUDENT
-  job_t *job = &jobs[j];
+  job_t *job = jobs[j];
   job->state = RUNNING;
   if (!bg) {
     // if foreground
-    Tcsetattr(tty_fd, 0, &shell_tmodes);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, 0, &shell_tmodes);
     // change attributes
     movejob(j, 0);
     // moving to fg
-    setfgpgrp(jobs[0].pgid);
+    setfgpgrp(jobs[0]->pgid);
     // setting fg process group
-    kill(-jobs[0].pgid, SIGCONT);
+    kill(-jobs[0]->pgid, SIGCONT);
     // resuming all processes in a group
     msg("[%d] continue '%s'\n", j, jobcmd(0));
-    monitorjob(mask);
+    monitorjob();
     // after all we start monitoring it
   } else {
     kill(-job->pgid, SIGCONT);
@@ -224,25 +386,27 @@ bool resumejob(int j, int bg, sigset_t *mask) {
 
 /* Kill the job by sending it a SIGTERM. */
 bool killjob(int j) {
-  if (j >= njobmax || jobs[j].state == FINISHED)
+  if (j >= njobmax || jobs[j]->state == FINISHED)
     return false;
-  debug("[%d] killing '%s'\n", j, jobs[j].command);
+  debug("[%d] killing '%s'\n", j, jobcmd(j));
 
   /* TODO: I love the smell of napalm in the morning. */
 #ifdef STUDENT
-  job_t *job = &jobs[j];
+  job_t *job = jobs[j];
   if (job->state == STOPPED) {
     // we search for stopped jobs
     setfgpgrp(job->pgid);
     // we change terminal attribute to job group
-    Tcsetattr(tty_fd, TCSAFLUSH, &jobs[j].tmodes);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, TCSAFLUSH, &jobs[j]->tmodes);
     kill(-job->pgid, SIGTERM);
     // after that we kill
     kill(-job->pgid, SIGCONT);
     // processes need to be woke up to answer the SIGTERM
     setfgpgrp(getpid());
     // at least we get back shell attributes and control
-    Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
+    if (tty_fd >= 0)
+      Tcsetattr(tty_fd, TCSAFLUSH, &shell_tmodes);
   }
   kill(-job->pgid, SIGTERM);
   // and then we kill
@@ -251,87 +415,215 @@ bool killjob(int j) {
   return true;
 }
 
-/* Report state of requested background jobs. Clean up finished jobs. */
-void watchjobs(int which) {
+#define KILL_GRACE 3000 /* default time [ms] jobs have to exit */
+
+/* Time between SIGTERM and SIGKILL is taken from $SHUTDOWN_GRACE
+ * in seconds. */
+unsigned killgrace(void) {
+  const char *s = getenv("SHUTDOWN_GRACE");
+  char *end;
+  double sec;
+
+  if (s == NULL || (sec = strtod(s, &end)) < 0 || end == s || *end)
+    return KILL_GRACE;
+  return min(sec * 1000, (double)UINT_MAX);
+}
+
+/* Job in a cgroup is killed with cgroup.kill, which also reaches processes
+ * that left job's process group. */
+static void sigkilljob(job_t *job) {
+  if (!job->cgroup || !cgkill(job->cgroup))
+    kill(-job->pgid, SIGKILL);
+}
+
+/* Timer of a job is keyed by its process group leader, since contents of
+ * job slots move around, but the leader stays in the processes index until
+ * the job gets deleted. First expiry sends SIGTERM, the second one SIGKILL. */
+static void jobexpired(void *arg) {
+  pident_t *pe = pidlookup((pid_t)(intptr_t)arg);
+  if (pe == NULL)
+    return;
+
+  int j = pe->job;
+  job_t *job = jobs[j];
+
+  evcancel(job->timer);
+  job->timer = NULL;
+
+  if (!job->timedout) {
+    if (j == FG)
+      msg("timed out '%s'\n", jobcmd(j));
+    else
+      msg("[%d] timed out '%s'\n", j, jobcmd(j));
+    job->timedout = true;
+    kill(-job->pgid, SIGTERM);
+    kill(-job->pgid, SIGCONT);
+    job->timer = evtimer(job->killdelay, jobexpired, arg);
+  } else {
+    sigkilljob(job);
+  }
+}
+
+/* Job's processes were started in cgroup `cg`, which is removed together
+ * with the job. */
+void setjobcgroup(int j, int cg) {
+  jobs[j]->cgroup = cg;
+}
+
+/* Terminate the job if it runs for longer than `msec` milliseconds,
+ * then kill it if it is still around after another `killdelay` ms. */
+void timeoutjob(int j, unsigned msec, unsigned killdelay) {
+  job_t *job = jobs[j];
+  if (job->state == FINISHED)
+    return;
+  job->killdelay = killdelay;
+  job->timer = evtimer(msec, jobexpired, (void *)(intptr_t)job->pgid);
+}
+
+/* Resource usage as reported by `watchjobs`. Running jobs are charged only
+ * for processes that have already finished. */
+static const char *jobusage(job_t *job) {
+  static char buf[256];
+  struct timespec now = job->finished;
+
+  if (job->state != FINISHED)
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double real = (now.tv_sec - job->started.tv_sec) +
+                (now.tv_nsec - job->started.tv_nsec) * 1e-9;
+  snprintf(buf, sizeof(buf), " (user %ld.%03lds, sys %ld.%03lds, real %.3fs, "
+           "maxrss %ldkB)", (long)job->utime.tv_sec,
+           (long)job->utime.tv_usec / 1000, (long)job->stime.tv_sec,
+           (long)job->stime.tv_usec / 1000, real, job->maxrss);
+  if (job->cgroup) {
+    /* Usage of the cgroup includes processes that are still running. */
+    size_t len = strlen(buf) - 1;
+    snprintf(buf + len, sizeof(buf) - len, ";%s)", cgusage(job->cgroup));
+  }
+  return buf;
+}
+
+/* Report state of requested background jobs. Clean up finished jobs.
+ * Finished jobs are always reported with their resource usage, other jobs
+ * only if `verbose` was requested. */
+void watchjobs(int which, bool verbose) {
+  /* Bring jobs' state up to date with children that changed state. */
+  evcheck();
+
   for (int j = BG; j < njobmax; j++) {
-    if (jobs[j].pgid == 0)
+    if (jobs[j]->pgid == 0)
       continue;
 
       /* TODO: Report job number, state, command and exit code or signal. */
 #ifdef STUDENT
-    job_t *job = &jobs[j];
+    job_t *job = jobs[j];
     if (which != ALL && job->state != which) {
       continue;
     }
     if (job->state == RUNNING) {
       // we print an appropriate message depends on a state
-      printf("[%d] running '%s'\n", j, job->command);
+      printf("[%d] running '%s'%s\n", j, jobcmd(j),
+             verbose ? jobusage(job) : "");
     } else if (job->state == STOPPED) {
-      printf("[%d] suspended '%s'\n", j, job->command);
+      printf("[%d] suspended '%s'%s\n", j, jobcmd(j),
+             verbose ? jobusage(job) : "");
     } else {
       // handling finished, we can finish the job by signal or by just
       // exiting the shell
       if (WIFSIGNALED(exitcode(job))) {
-        msg("[%d] killed '%s' by signal %d\n", j, job->command,
-            WTERMSIG(exitcode(job)));
+        msg("[%d] killed '%s' by signal %d%s\n", j, jobcmd(j),
+            WTERMSIG(exitcode(job)), jobusage(job));
       } else if (WIFEXITED(exitcode(job))) {
-        msg("[%d] exited '%s', status=%d\n", j, job->command,
-            WEXITSTATUS(exitcode(job)));
+        msg("[%d] exited '%s', status=%d%s\n", j, jobcmd(j),
+            WEXITSTATUS(exitcode(job)), jobusage(job));
       }
-      deljob(job);
+      deljob(j);
     }
 #endif /* !STUDENT */
   }
 }
 
+/* Are there background jobs that finished but were not reported yet? */
+bool finishedjobs(void) {
+  for (int j = BG; j < njobmax; j++)
+    if (jobs[j]->pgid && jobs[j]->state == FINISHED)
+      return true;
+  return false;
+}
+
 /* Monitor job execution. If it gets stopped move it to background.
  * When a job has finished or has been stopped move shell to foreground. */
-int monitorjob(sigset_t *mask) {
+int monitorjob(void) {
   int exitcode = 0, state;
 
   /* TODO: Following code requires use of Tcsetpgrp of tty_fd. */
 #ifdef STUDENT
-  job_t *job = &jobs[0];
-  Tcsetpgrp(tty_fd, job->pgid);
+  job_t *job = jobs[0];
+  uint64_t start = phasestart();
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, job->pgid);
   // we give control over terminal to a pgid of a job
+  phaseend(PH_TTY, start);
+  start = phasestart();
   state = jobstate(0, &exitcode);
   // we save job state
   while (state == RUNNING) {
-    Sigsuspend(mask);
-    // if running, we turn off the signal mask
+    evwait();
+    // if running, we wait for the event loop to reap children
     state = jobstate(0, &exitcode);
   }
+  phaseend(PH_WAIT, start);
+  start = phasestart();
   if (state == STOPPED) {
-    Tcgetattr(tty_fd, &jobs[0].tmodes);
+    // status tells which signal stopped the job
+    for (int i = 0; i < job->nproc; i++)
+      if (job->proc[i].state == STOPPED)
+        exitcode = job->proc[i].exitcode;
+    if (tty_fd >= 0)
+      Tcgetattr(tty_fd, &jobs[0]->tmodes);
     // we save terminal settings to bring it back then
+    (void)jobcmd(0);
+    // render the command before its arguments are gone
     int new = allocjob();
     // we allocate a place in jobs
     movejob(0, new);
     // and move the stopped job there
   }
-  Tcsetattr(tty_fd, 0, &shell_tmodes);
-  // bring back terminal settings
-  Tcsetpgrp(tty_fd, getpgrp());
-  // bring back control
+  if (tty_fd >= 0) {
+    Tcsetattr(tty_fd, 0, &shell_tmodes);
+    // bring back terminal settings
+    Tcsetpgrp(tty_fd, getpgrp());
+    // bring back control
+  }
+  phaseend(PH_TTY, start);
 #endif /* !STUDENT */
 
   return exitcode;
 }
 
-/* Called just at the beginning of shell's life. */
-void initjobs(void) {
-  struct sigaction act = {
-    .sa_flags = SA_RESTART,
-    .sa_handler = sigchld_handler,
-  };
-
-  /* Block SIGINT for the duration of `sigchld_handler`
-   * in case `sigint_handler` does something crazy like `longjmp`. */
-  sigemptyset(&act.sa_mask);
-  sigaddset(&act.sa_mask, SIGINT);
-  Sigaction(SIGCHLD, &act, NULL);
-
-  jobs = calloc(sizeof(job_t), 1);
+/* Called just at the beginning of shell's life. Without `interactive` there's
+ * no job control, but if the shell runs in foreground of a terminal, its
+ * foreground jobs get the terminal, since they have process groups of their
+ * own and would be stopped by SIGTTIN or SIGTTOU otherwise. */
+void initjobs(bool interactive) {
+  /* Children are reaped by the event loop, never in a signal handler. */
+  evsignal(SIGCHLD, reapjobs, NULL);
+
+  growjobs();
+  bit_set(jobused, FG);
+
+  if (!interactive) {
+    int fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (fd >= 0 && tcgetpgrp(fd) == getpgrp()) {
+      tty_fd = movefd(fd);
+      // taking the terminal back must not stop the shell
+      Signal(SIGTTOU, SIG_IGN);
+      Tcgetattr(tty_fd, &shell_tmodes);
+    } else if (fd >= 0) {
+      Close(fd);
+    }
+    return;
+  }
 
   /* Assume we're running in interactive mode, so move us to foreground.
    * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
@@ -346,34 +638,61 @@ void initjobs(void) {
   Tcgetattr(tty_fd, &shell_tmodes);
 }
 
+#ifdef STUDENT
+static bool alivejob(int j) {
+  return jobs[j]->pgid != 0 && jobs[j]->state != FINISHED;
+}
+
+/* Jobs that ignored SIGTERM for too long don't get another chance. */
+static void killstragglers(void *arg) {
+  (void)arg;
+  for (int j = BG; j < njobmax; j++) {
+    if (!alivejob(j))
+      continue;
+    debug("[%d] SIGKILL '%s'\n", j, jobcmd(j));
+    sigkilljob(jobs[j]);
+  }
+}
+#endif /* !STUDENT */
+
 /* Called just before the shell finishes. */
 void shutdownjobs(void) {
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
-
   /* TODO: Kill remaining jobs and wait for them to finish. */
 #ifdef STUDENT
-  for (int i = 1; i < njobmax; i++) {
-    // if job is finished, we do nothing, if not, we kill it
-    if (jobs[i].pgid == 0 || jobs[i].state == FINISHED) {
-      continue;
-    }
-    killjob(i);
-    while (jobs[i].state != FINISHED) {
-      // suspending signals for the killing process
-      Sigsuspend(&mask);
+  // all jobs get the signal first and terminate concurrently,
+  // so shutdown takes as long as the slowest job, not all of them
+  int alive = 0;
+  for (int i = BG; i < njobmax; i++) {
+    if (alivejob(i)) {
+      killjob(i);
+      alive++;
     }
   }
+  event_t *timer = NULL;
+  if (alive)
+    timer = evtimer(killgrace(), killstragglers, NULL);
+  for (int i = BG; i < njobmax; i++) {
+    // waiting for the killed processes to be reaped
+    while (alivejob(i))
+      evwait();
+  }
+  evcancel(timer);
 #endif /* !STUDENT */
 
-  watchjobs(FINISHED);
+  watchjobs(FINISHED, false);
+  cgfini();
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  if (tty_fd >= 0)
+    Close(tty_fd);
+}
 
-  Close(tty_fd);
+/* Returns terminal that foreground jobs should take control of or -1. */
+int ttyfd(void) {
+  return tty_fd;
 }
 
 /* Sets foreground process group to `pgid`. */
 void setfgpgrp(pid_t pgid) {
-  Tcsetpgrp(tty_fd, pgid);
+  if (tty_fd >= 0)
+    Tcsetpgrp(tty_fd, pgid);
 }
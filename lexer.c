@@ -1,72 +1,125 @@
 #include "shell.h"
 
-void strapp(char **dstp, const char *src) {
-  assert(dstp != NULL);
-
-  if (*dstp == NULL) {
-    *dstp = strdup(src);
-  } else {
-    size_t s = strlen(*dstp) + strlen(src) + 1;
-    *dstp = realloc(*dstp, s);
-    strcat(*dstp, src);
-  }
+/* Make sure `sb` has room for `n` more characters and the terminating NUL.
+ * Buffer grows geometrically, so appending is amortized linear. */
+void sbreserve(strbuf_t *sb, size_t n) {
+  if (sb->len + n + 1 <= sb->size)
+    return;
+  sb->size = max(sb->len + n + 1, 2 * sb->size);
+  sb->data = Realloc(sb->data, sb->size);
+}
+
+void sbappend(strbuf_t *sb, const char *src) {
+  size_t n = strlen(src);
+  sbreserve(sb, n);
+  memcpy(sb->data + sb->len, src, n + 1);
+  sb->len += n;
+}
+
+/* Make the string empty, but keep the buffer for reuse. */
+void sbreset(strbuf_t *sb) {
+  sb->len = 0;
+  if (sb->data)
+    sb->data[0] = '\0';
+}
+
+/* Character classes recognized by the scanner. */
+enum { C_WORD = 0, C_SPACE, C_OPER, C_END };
+
+static const char ctype[256] = {
+  [0] = C_END,
+  [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+  ['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE,
+  ['|'] = C_OPER,  ['&'] = C_OPER,  ['<'] = C_OPER,
+  ['>'] = C_OPER,  [';'] = C_OPER,  ['!'] = C_OPER,
+};
+
+/* Token vector is an arena reused by consecutive calls to `tokenize`.
+ * It only grows, so after a few lines tokenizing does not allocate. */
+static token_t *tokvec = NULL;
+static int tokmax = 0;
+
+static void growtokens(void) {
+  tokmax = max(2 * tokmax, 64);
+  tokvec = Realloc(tokvec, sizeof(token_t) * tokmax);
 }
 
+/* Split the line in a single pass. Returned vector belongs to the lexer and
+ * stays valid until the next call. */
 token_t *tokenize(char *s, int *tokc_p) {
-  int capacity = 10;
+  unsigned char *p = (unsigned char *)s;
   int ntoks = 0;
 
-  token_t *tokvec = malloc(sizeof(token_t) * (capacity + 1));
+  if (tokvec == NULL)
+    growtokens();
+
+  for (;;) {
+    int c = ctype[*p];
+
+    if (c == C_END)
+      break;
 
-  while (*s != 0) {
     /* Consume whitespace characters. */
-    if (isspace(*s)) {
-      *s++ = 0;
+    if (c == C_SPACE) {
+      *p++ = 0;
       continue;
     }
 
-    /* Make sure there's enough space to add new token. */
-    if (ntoks == capacity) {
-      capacity *= 2;
-      tokvec = realloc(tokvec, sizeof(token_t) * (capacity + 1));
-    }
+    /* Make sure there's enough space to add new tokens and terminator. */
+    if (ntoks + 2 >= tokmax)
+      growtokens();
 
-    size_t l = strcspn(s, " |&<>;!");
-    if (l > 0) {
-      tokvec[ntoks++] = s;
-      s += l;
+    if (c == C_WORD) {
+      unsigned char *word = p;
+      while (ctype[*++p] == C_WORD)
+        continue;
+      /* Single digit just before < or > is the descriptor to redirect. */
+      if (p - word == 1 && isdigit(*word) && (*p == '<' || *p == '>'))
+        tokvec[ntoks++] = T_IONUM;
+      tokvec[ntoks++] = (token_t)word;
       continue;
     }
 
     token_t tok;
 
-    if (s[0] == '|') {
-      if (s[1] == '|') {
-        *s++ = 0;
+    if (p[0] == '|') {
+      if (p[1] == '|') {
+        *p++ = 0;
         tok = T_OR;
       } else {
         tok = T_PIPE;
       }
-    } else if (s[0] == '&') {
-      if (s[1] == '&') {
-        *s++ = 0;
+    } else if (p[0] == '&') {
+      if (p[1] == '&') {
+        *p++ = 0;
         tok = T_AND;
       } else {
         tok = T_BGJOB;
       }
-    } else if (s[0] == '<') {
-      tok = T_INPUT;
-    } else if (s[0] == '>') {
-      tok = T_OUTPUT;
-    } else if (s[0] == ';') {
+    } else if (p[0] == '<') {
+      if (p[1] == '&') {
+        *p++ = 0;
+        tok = T_DUPIN;
+      } else {
+        tok = T_INPUT;
+      }
+    } else if (p[0] == '>') {
+      if (p[1] == '>') {
+        *p++ = 0;
+        tok = T_APPEND;
+      } else if (p[1] == '&') {
+        *p++ = 0;
+        tok = T_DUPOUT;
+      } else {
+        tok = T_OUTPUT;
+      }
+    } else if (p[0] == ';') {
       tok = T_COLON;
-    } else if (s[0] == '!') {
-      tok = T_BANG;
     } else {
-      continue;
+      tok = T_BANG;
     }
 
-    *s++ = 0;
+    *p++ = 0;
     tokvec[ntoks++] = tok;
   }
 
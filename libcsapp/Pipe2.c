@@ -0,0 +1,9 @@
+#include "csapp.h"
+
+/* Declared by <unistd.h> only with _GNU_SOURCE. */
+int pipe2(int fds[2], int flags);
+
+void Pipe2(int fds[2], int flags) {
+  if (pipe2(fds, flags) < 0)
+    unix_error("Pipe2 error");
+}
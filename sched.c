@@ -0,0 +1,183 @@
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "shell.h"
+
+/* Scheduling attributes of jobs: CPU affinity, nice level and I/O priority.
+ * posix_spawn cannot set them in the child, but on Linux all three belong
+ * to a thread and a new process copies them from the thread that created
+ * it. So the shell spawns such a process from a short-lived thread that
+ * takes the attributes first. The process starts with them already in
+ * place and the shell's own thread is never changed, which matters for the
+ * nice level that an unprivileged shell could not lower back. System calls
+ * are used directly, as glibc only declares cpu_set_t with _GNU_SOURCE. */
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+#define WORDBITS (8 * sizeof(unsigned long))
+#define cpubit(cpu) (1UL << ((cpu) % WORDBITS))
+#define cpuset(cpus, cpu) ((cpus)[(cpu) / WORDBITS] |= cpubit(cpu))
+#define cpuisset(cpus, cpu) ((cpus)[(cpu) / WORDBITS] & cpubit(cpu))
+
+/* Parse list of CPUs like "0-3,8,10-11". */
+static bool parse_cpus(const char *s, sched_t *sc) {
+  memset(sc->cpus, 0, sizeof(sc->cpus));
+
+  while (*s) {
+    char *end;
+    long lo = strtol(s, &end, 10), hi = lo;
+    if (end == s)
+      return false;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtol(s, &end, 10);
+      if (end == s)
+        return false;
+    }
+    if (lo < 0 || hi < lo || hi >= MAXCPU)
+      return false;
+    for (long cpu = lo; cpu <= hi; cpu++)
+      cpuset(sc->cpus, cpu);
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return false;
+    s = end;
+  }
+  return true;
+}
+
+/* Parse I/O priority like ionice(1) does: class rt, be or idle, optionally
+ * followed by a colon and level from 0 (highest) to 7. */
+static bool parse_ioprio(const char *s, sched_t *sc) {
+  static const char *classes[] = {"rt", "be", "idle"};
+  size_t len = strcspn(s, ":");
+  int level = 4;
+
+  if (s[len] == ':') {
+    char *end;
+    level = strtol(s + len + 1, &end, 10);
+    if (end == s + len + 1 || *end || level < 0 || level > 7)
+      return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (strlen(classes[i]) == len && !strncmp(s, classes[i], len)) {
+      sc->ioprio = ((i + 1) << IOPRIO_CLASS_SHIFT) | (i == 2 ? 0 : level);
+      sc->setioprio = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Consume options of `sched` prefix word, i.e.
+ *  -c CPULIST or -c auto: run on given CPUs or on a single CPU chosen in
+ *     round robin fashion, so that stages of a pipeline get distinct CPUs,
+ *  -n INCREMENT: add to nice level of the shell like nice(1),
+ *  -i CLASS[:LEVEL]: set I/O scheduling class and priority like ionice(1).
+ * Returns number of consumed tokens or -1 on error. */
+int parse_sched(token_t *token, int ntokens, sched_t *sc) {
+  int i = 0;
+
+  for (; i + 1 < ntokens && string_p(token[i]); i += 2) {
+    const char *opt = token[i], *arg = token[i + 1];
+    bool ok = string_p(arg);
+
+    if (!strcmp(opt, "-c")) {
+      sc->autocpu = ok && !strcmp(arg, "auto");
+      sc->setcpus = ok && (sc->autocpu || parse_cpus(arg, sc));
+      ok = sc->setcpus;
+    } else if (!strcmp(opt, "-n")) {
+      char *end;
+      sc->nice = ok ? strtol(arg, &end, 10) : 0;
+      ok = ok && end != arg && *end == '\0';
+      sc->setnice = true;
+    } else if (!strcmp(opt, "-i")) {
+      ok = ok && parse_ioprio(arg, sc);
+    } else {
+      break;
+    }
+
+    if (!ok) {
+      msg("sched: %s: invalid argument of %s\n", string_p(arg) ? arg : "",
+          opt);
+      return -1;
+    }
+  }
+
+  return i;
+}
+
+/* Pick the next CPU the shell is allowed to run on. */
+static void autocpu(unsigned long *cpus) {
+  static int next = 0;
+  unsigned long allowed[CPUWORDS] = {0};
+
+  if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0)
+    return;
+
+  for (int k = 0; k < MAXCPU; k++) {
+    int cpu = (next + k) % MAXCPU;
+    if (cpuisset(allowed, cpu)) {
+      memset(cpus, 0, sizeof(allowed));
+      cpuset(cpus, cpu);
+      next = cpu + 1;
+      return;
+    }
+  }
+}
+
+typedef struct {
+  const sched_t *sc;
+  unsigned long cpus[CPUWORDS]; /* affinity with "auto" already resolved */
+  void (*fn)(void *);
+  void *arg;
+} schedcall_t;
+
+/* Calling thread takes the attributes, errors are reported but otherwise
+ * ignored, like with nice(1) in some shells. */
+static void schedapply(schedcall_t *call) {
+  const sched_t *sc = call->sc;
+
+  if (sc->setcpus && syscall(SYS_sched_setaffinity, 0, sizeof(call->cpus),
+                             call->cpus) < 0)
+    msg("sched: cannot set CPU affinity: %s\n", strerror(errno));
+
+  if (sc->setioprio &&
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sc->ioprio) < 0)
+    msg("sched: cannot set I/O priority: %s\n", strerror(errno));
+
+  if (sc->setnice) {
+    errno = 0;
+    int prio = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0)
+      prio = max(min(prio + sc->nice, 19), -20);
+    if (errno || setpriority(PRIO_PROCESS, 0, prio) < 0)
+      msg("sched: cannot set nice level: %s\n", strerror(errno));
+  }
+}
+
+static void *schedthread(void *arg) {
+  schedcall_t *call = arg;
+  schedapply(call);
+  call->fn(call->arg);
+  return NULL;
+}
+
+/* Call `fn` with given scheduling attributes, so that processes it creates
+ * inherit them. The shell waits until `fn` returns. */
+void schedrun(const sched_t *sc, void (*fn)(void *), void *arg) {
+  if (sc == NULL || (!sc->setcpus && !sc->setnice && !sc->setioprio)) {
+    fn(arg);
+    return;
+  }
+
+  schedcall_t call = {.sc = sc, .fn = fn, .arg = arg};
+  memcpy(call.cpus, sc->cpus, sizeof(call.cpus));
+  if (sc->setcpus && sc->autocpu)
+    autocpu(call.cpus);
+
+  pthread_t tid;
+  Pthread_create(&tid, NULL, schedthread, &call);
+  Pthread_join(tid, NULL);
+}
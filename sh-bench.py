@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+# Latency benchmarks for the shell. Each measurement is repeated a number of
+# times and reported as percentiles, so runs can be compared with each other.
+
+import argparse
+import pexpect
+import time
+
+PROMPT = '# '
+
+
+def percentile(samples, p):
+    samples = sorted(samples)
+    k = (len(samples) - 1) * p / 100
+    lo, hi = int(k), min(int(k) + 1, len(samples) - 1)
+    return samples[lo] + (samples[hi] - samples[lo]) * (k - lo)
+
+
+def report(name, samples):
+    us = [s * 1e6 for s in samples]
+    print('{:<28} n={:<5} p50={:>9.1f} p90={:>9.1f} p99={:>9.1f} '
+          'max={:>9.1f} [us]'.format(
+              name, len(us), percentile(us, 50), percentile(us, 90),
+              percentile(us, 99), max(us)))
+
+
+class Shell():
+    def __init__(self):
+        self.child = pexpect.spawn('./shell', timeout=10)
+        self.child.setecho(False)
+        # pexpect sleeps by default before each send and after close
+        self.child.delaybeforesend = None
+        self.child.delayafterclose = 0
+        self.child.expect_exact(PROMPT)
+
+    def run(self, cmd):
+        """Returns time elapsed between sending the command and next prompt."""
+        start = time.perf_counter()
+        self.child.sendline(cmd)
+        self.child.expect_exact(PROMPT)
+        return time.perf_counter() - start
+
+    def quit(self):
+        start = time.perf_counter()
+        self.child.sendline('quit')
+        self.child.expect(pexpect.EOF)
+        self.child.wait()
+        elapsed = time.perf_counter() - start
+        self.child.close()
+        return elapsed
+
+
+def bench_startup(args):
+    samples = []
+    for _ in range(args.warmup + args.startups):
+        start = time.perf_counter()
+        sh = Shell()
+        samples.append(time.perf_counter() - start)
+        sh.quit()
+    report('time-to-first-prompt', samples[args.warmup:])
+
+
+def bench_command(args):
+    sh = Shell()
+    # builtin and the same utility started as a process
+    for cmd in ['true', '/bin/true']:
+        for _ in range(args.warmup):
+            sh.run(cmd)
+        report('command ({})'.format(cmd),
+               [sh.run(cmd) for _ in range(args.runs)])
+    sh.quit()
+
+
+def bench_pipeline(args):
+    sh = Shell()
+    for nstages in args.stages:
+        cmd = ' | '.join(['/bin/true'] * nstages)
+        for _ in range(args.warmup):
+            sh.run(cmd)
+        report('pipeline ({} stages)'.format(nstages),
+               [sh.run(cmd) for _ in range(args.runs)])
+    sh.quit()
+
+
+def bench_jobs(args):
+    """Cost of reaping children and reporting jobs with many jobs around."""
+    for njobs in args.jobs:
+        sh = Shell()
+        for _ in range(njobs):
+            sh.run('sleep 1000 &')
+        for _ in range(args.warmup):
+            sh.run('/bin/true')
+        report('command ({} bg jobs)'.format(njobs),
+               [sh.run('/bin/true') for _ in range(args.runs)])
+        report('shutdown ({} bg jobs)'.format(njobs), [sh.quit()])
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Shell latency benchmarks.')
+    parser.add_argument('-n', '--runs', type=int, default=200,
+                        help='measurements per data point')
+    parser.add_argument('-w', '--warmup', type=int, default=10,
+                        help='measurements to discard before each data point')
+    parser.add_argument('--startups', type=int, default=50,
+                        help='number of shells to start')
+    parser.add_argument('--stages', type=int, nargs='+',
+                        default=[1, 2, 4, 8, 16])
+    parser.add_argument('--jobs', type=int, nargs='+',
+                        default=[0, 16, 64, 256])
+    args = parser.parse_args()
+
+    bench_startup(args)
+    bench_command(args)
+    bench_pipeline(args)
+    bench_jobs(args)
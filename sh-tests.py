@@ -5,17 +5,22 @@
 
 import os
 import pexpect
+import shutil
+import signal
 import unittest
 import subprocess
 import random
 import time
 import sys
-from tempfile import NamedTemporaryFile
+from tempfile import NamedTemporaryFile, TemporaryDirectory
 
 
 LOGFILE = 'sh-tests.{}.log'.format(os.getpid())
 LD_PRELOAD = './trace.so'
 BADFNS = ['sleep', 'poll', 'select', 'alarm']
+# Keep tests from recording their commands in user's history.
+HISTDIR = TemporaryDirectory(prefix='sh-tests.')
+os.environ['HISTFILE'] = os.path.join(HISTDIR.name, 'history')
 
 
 class ShellTesterSimple():
@@ -83,6 +88,13 @@ class ShellTesterSimple():
             before.pop(0)
         return before
 
+    def sync(self):
+        """ Skips output up to the prompt of a command issued from now on,
+        e.g. when a job was reported either before or after the prompt. """
+        self.sendline('echo synced')
+        self.expect_exact('synced')
+        self.expect('#')
+
     def log(self, msg):
         self.child.logfile.write(f'{msg}\n'.encode('utf-8'))
 
@@ -147,15 +159,13 @@ class ShellTester(ShellTesterSimple):
 
     def expect_waitpid(self, pid=None, status=None):
         while True:
-            res = self.expect_syscall('waitpid')
+            res = self.expect_syscall('(?:waitpid|wait4)')
             if res['pid'] == pid and res.get('status', None) == status:
                 break
         self.assertEqual(status, res.get('status', -1))
 
     def expect_spawn(self):
-        result = self.expect_fork(parent=self.pid)
-        self.expect_execve(child=result['retval'])
-        return result
+        return self.expect_syscall('posix_spawn', caller=self.pid)
 
 
 class TestShellSimple(ShellTesterSimple, unittest.TestCase):
@@ -190,6 +200,40 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
                 self.execute('wc -l ' + inf.name + ' >' + outf.name)
                 self.assertEqual(outf.read().split()[0], str(n))
 
+    def test_redir_3(self):
+        with NamedTemporaryFile(mode='r') as outf:
+            # 'echo a > out', 'echo b >> out'
+            self.execute('echo a >' + outf.name)
+            self.execute('echo b >>' + outf.name)
+            self.assertEqual(outf.read(), 'a\nb\n')
+
+        with NamedTemporaryFile(mode='r') as outf:
+            # 'ls /nonexistent > out 2>&1'
+            self.execute('ls /nonexistent >' + outf.name + ' 2>&1')
+            self.assertIn('/nonexistent', outf.read())
+
+        with NamedTemporaryFile(mode='w') as script:
+            # 'sh fds 2>&- 3</dev/null' where 'fds' lists its descriptors
+            script.write('for fd in 0 1 2 3; do\n'
+                         '  [ -e /proc/$$/fd/$fd ] && echo $fd\n'
+                         'done\n'
+                         'readlink /proc/$$/fd/3\n')
+            script.flush()
+            lines = self.execute('sh ' + script.name + ' 2>&- 3</dev/null')
+            self.assertEqual(lines, ['0', '1', '3', '/dev/null'])
+
+        # only descriptors opened by the command can be copied
+        lines = self.execute('echo a 1>&3')
+        self.assertEqual(lines, ['3: bad file descriptor'])
+        with NamedTemporaryFile(mode='r') as outf:
+            self.execute('echo a 3>' + outf.name + ' 1>&3')
+            self.assertEqual(outf.read(), 'a\n')
+
+        # stage without a command fails the whole pipeline
+        lines = self.execute('>/dev/null | cat')
+        self.assertEqual(lines, ['syntax error: missing command in pipeline'])
+        self.assertEqual(self.execute('echo alive'), ['alive'])
+
     def test_pipeline_1(self):
         lines = self.execute('grep LIST include/queue.h | wc -l')
         self.assertEqual(lines[0], '46')
@@ -231,6 +275,11 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
 
         # check shell 'ls -l /proc/$pid/fd'
         lines = self.execute('ls -l /proc/%d/fd' % self.pid)
+        # descriptors used by the event loop and history are expected
+        lines = [line for line in lines
+                 if 'anon_inode:[eventpoll]' not in line and
+                 'anon_inode:[signalfd]' not in line and
+                 os.environ['HISTFILE'] not in line]
         self.assertEqual(len(lines), 5)
         for i in range(4):
             self.assertIn('%d -> /dev/pts/' % i, lines[i + 1])
@@ -304,6 +353,284 @@ class TestShellSimple(ShellTesterSimple, unittest.TestCase):
         self.expect_exact("[1] killed 'sleep 1000' by signal 15")
         self.expect_exact("[2] killed 'sleep 2000' by signal 15")
 
+    def test_hash(self):
+        self.sendline('hash')
+        self.expect_exact('hash: hash table empty')
+        self.execute('uname')
+        self.sendline('hash')
+        # shell finds the same file as the first match in PATH
+        self.expect_exact('1\t' + shutil.which('uname'))
+        self.sendline('hash -r')
+        self.sendline('hash')
+        self.expect_exact('hash: hash table empty')
+
+    def test_stats(self):
+        self.sendline('stats -r')
+        self.execute('uname')
+        self.sendline('stats')
+        self.expect('spawn +1 ')
+        self.expect('wait +1 ')
+        # pipe2, 2 spawns, 5 file actions and 2 closes of pipe ends
+        self.sendline('stats -r')
+        self.execute('true | cat')
+        self.sendline('stats')
+        self.expect_exact('pipelines 1, system calls 10, last 10')
+        # builtins are charged only when they run, without waiting for jobs
+        self.sendline('sleep 0.5 &')
+        self.expect_exact("running 'sleep 0.5'")
+        self.execute('stats -r')
+        self.execute('kill 999999')
+        self.execute('fg')
+        self.sendline('stats')
+        self.expect(r'builtin +(\d+) +([\d.]+) ')
+        count, total = self.child.match.groups()
+        self.assertEqual(int(count), 2)
+        self.assertLess(float(total), 100000)
+
+    def test_builtin_utils(self):
+        with NamedTemporaryFile(mode='r') as outf:
+            self.sendline('stats -r')
+            self.sendline('printf %s-%03d\\n a 7 b 8 > ' + outf.name)
+            self.sendline('echo -n x >> {0}; echo y 2>&1 >> {0}'.format(
+                outf.name))
+            self.sendline('[ 2 -gt 10 ] || test -d / && echo ok')
+            self.expect_exact('ok')
+            self.assertEqual(outf.read(), 'a-007\nb-008\nxy\n')
+            # shell's own descriptors are put back after redirections
+            self.execute('false 2> ' + outf.name)
+            self.sendline('echo $ 1>&2')
+            self.expect_exact('$')
+            self.sendline('stats')
+            self.expect('builtin +9 ')
+            self.assertNotIn(b'spawn', self.child.before)
+            # formats and options the builtins lack are left to programs
+            for cmd, out in [('printf %.2f\\n 3.14159', b'3.14\n'),
+                             ('echo -e a\\tb', b'a\tb\n')]:
+                run = subprocess.run(['./shell', '-c', cmd], timeout=10,
+                                     stdout=subprocess.PIPE)
+                self.assertEqual(run.stdout, out)
+                self.assertEqual(run.returncode, 0)
+
+    def test_batch(self):
+        script = b'# comment\necho one | tr o O\nfalse\n'
+        run = subprocess.run(['./shell'], input=script, timeout=10,
+                             stdout=subprocess.PIPE)
+        self.assertEqual(run.stdout, b'One\n')
+        self.assertEqual(run.returncode, 1)
+        run = subprocess.run(['./shell', '-c', 'echo two'], timeout=10,
+                             stdout=subprocess.PIPE)
+        self.assertEqual(run.stdout, b'two\n')
+        self.assertEqual(run.returncode, 0)
+        # long lines are not split, blank lines keep the exit code
+        script = b'echo ' + b'x' * 10000 + b' | wc -c\nfalse\n  \n'
+        run = subprocess.run(['./shell'], input=script, timeout=10,
+                             stdout=subprocess.PIPE)
+        self.assertEqual(run.stdout, b'10001\n')
+        self.assertEqual(run.returncode, 1)
+        # commands read the rest of a seekable script from standard input
+        with NamedTemporaryFile(mode='w+') as script:
+            script.write('head -n 1\nline\necho after\n')
+            script.flush()
+            script.seek(0)
+            run = subprocess.run(['./shell'], stdin=script, timeout=10,
+                                 stdout=subprocess.PIPE)
+            self.assertEqual(run.stdout, b'line\nafter\n')
+        # command that cannot be started
+        run = subprocess.run(['./shell', '-c', 'true | no-such-command'],
+                             timeout=10, stderr=subprocess.DEVNULL)
+        self.assertEqual(run.returncode, 127)
+
+    def test_batch_tty(self):
+        # foreground job of a shell running a command gets the terminal
+        child = pexpect.spawn('./shell', ['-c', 'cat'], timeout=5)
+        child.sendline('hello')
+        child.expect_exact('hello\r\nhello')
+        child.sendeof()
+        child.expect(pexpect.EOF)
+        child.close()
+        self.assertEqual(child.exitstatus, 0)
+
+    def test_command_list(self):
+        self.sendline('false && echo A || echo B; ! true || echo C')
+        self.expect_exact('B')
+        self.expect_exact('C')
+        self.sendline('true || echo D && echo E')
+        self.expect_exact('E')
+
+    def test_shutdown(self):
+        with NamedTemporaryFile(mode='w', delete=False) as stubf:
+            stubf.write('#!/bin/sh\ntrap "" TERM\nsleep 100\n')
+        os.chmod(stubf.name, 0o755)
+        # jobs ignoring SIGTERM are killed together once grace period ends
+        script = ('{} &\n'.format(stubf.name) * 4 + 'sleep 100 &\n' +
+                  'sleep 0.5\n').encode()
+        env = dict(os.environ, SHUTDOWN_GRACE='1')
+        start = time.monotonic()
+        run = subprocess.run(['./shell'], input=script, timeout=10,
+                             stderr=subprocess.PIPE, env=env)
+        elapsed = time.monotonic() - start
+        os.unlink(stubf.name)
+        self.assertEqual(run.stderr.count(b'by signal 9'), 4)
+        self.assertEqual(run.stderr.count(b'by signal 15'), 1)
+        self.assertGreater(elapsed, 1.5)
+        self.assertLess(elapsed, 3.5)
+
+    def test_limit(self):
+        script = (b'limit -c abc true\nlimit -m 0 true\n'
+                  b'limit -c 50 -m 64M sleep 0.5 &\njobs -l\nsleep 1\n'
+                  b'limit grep ^0:: /proc/self/cgroup | cat\n')
+        run = subprocess.run(['./shell'], input=script, timeout=10,
+                             stderr=subprocess.STDOUT, stdout=subprocess.PIPE)
+        self.assertIn(b'limit: abc: invalid percentage', run.stdout)
+        self.assertIn(b'limit: 0: invalid size', run.stdout)
+        # without a delegated cgroup the job runs anyway
+        self.assertIn(b"[1] exited 'sleep 0.5'", run.stdout)
+        if b'jobs run without limits' in run.stdout:
+            self.skipTest('no delegated cgroup')
+        self.assertIn(b'cgroup cpu', run.stdout)
+        # processes of a pipeline are created right in the job's cgroup
+        self.assertRegex(run.stdout, rb'\n0::\S*/job\.\d+\.\d+\n')
+        # the shell's leaf is removed when it exits
+        with open('/proc/self/mountinfo') as f:
+            mnt = [line.split()[4] for line in f if ' - cgroup2 ' in line]
+        with open('/proc/self/cgroup') as f:
+            cg = [line[3:].strip() for line in f if line.startswith('0::')]
+        base = mnt[0] + (cg[0] if cg[0] != '/' else '')
+        self.assertFalse(os.path.exists(os.path.join(base, 'shell')))
+
+    def test_sched(self):
+        script = (b'sched -n 5 nice\n'
+                  b'sched -n 2 -c 0 nice | sched -n 7 cat - /proc/self/stat\n'
+                  b'sched -c 0 grep Cpus_allowed_list /proc/self/status\n'
+                  b'sched -c auto grep Cpus_allowed_list /proc/self/status\n'
+                  b'nice | sched -n x nice\n')
+        run = subprocess.run(['./shell'], input=script, timeout=10,
+                             stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        # each stage got its own nice level, auto picks a single CPU
+        self.assertRegex(run.stdout, b'^5\n2\n\\d+ \\(cat\\) .*\n'
+                         b'Cpus_allowed_list:\t0\n'
+                         b'Cpus_allowed_list:\t\\d+\n$')
+        # nice value is the 19th field of /proc/PID/stat
+        stat = run.stdout.split(b'\n')[2].split(b') ')[1].split()
+        self.assertEqual(stat[16], b'7')
+        # no stage runs if attributes of any of them are malformed
+        self.assertIn(b'sched: x: invalid argument of -n', run.stderr)
+
+    def test_coproc(self):
+        self.execute('coproc up sed -u s/h/H/ | cat')
+        self.execute('echo hello >&up')
+        self.assertEqual(self.execute('head -n 1 <&up'), ['Hello'])
+        lines = self.execute('ls -l /proc/%d/fd' % self.pid)
+        self.assertTrue(any('socket:' in line for line in lines))
+        # shell closes its end of the channel once the job is gone
+        self.sendline('kill %1')
+        self.expect_exact("[1] killed 'sed -u s/h/H/ | cat'")
+        self.sync()
+        lines = self.execute('ls -l /proc/%d/fd' % self.pid)
+        self.assertTrue(any('eventpoll' in line for line in lines))
+        self.assertFalse(any('socket:' in line for line in lines))
+        self.sendline('echo hello >&up')
+        self.expect_exact('up: bad file descriptor')
+        self.expect('#')
+        # shutting the channel down lets the coprocess see end of input,
+        # its output can be read even after its exit was reported
+        self.execute('coproc s sort')
+        self.execute('echo b >&s')
+        lines = self.execute('/bin/echo a >&s-')
+        if not any("exited 'sort'" in line for line in lines):
+            self.expect_exact("exited 'sort'")
+            self.sync()
+        self.assertEqual(self.execute('cat <&s'), ['a', 'b'])
+        self.sendline('coproc')
+        self.expect_exact('coproc: missing name')
+
+    def test_trace(self):
+        with TemporaryDirectory() as tmpdir:
+            ring = os.path.join(tmpdir, 'ring')
+            env = dict(os.environ, LD_PRELOAD=LD_PRELOAD, TRACE_RING=ring)
+            subprocess.run(['./shell', '-c', 'true | cat'], env=env,
+                           stdin=subprocess.DEVNULL, timeout=10)
+            run = subprocess.run(['./tracedump', ring], timeout=10,
+                                 stdout=subprocess.PIPE)
+            events = run.stdout.decode('utf-8')
+            self.assertRegex(events, r'posix_spawn\("/\S+/true", .*\) = \d+')
+            self.assertRegex(events, r'posix_spawn\("/\S+/cat", .*\) = \d+')
+            self.assertEqual(events.count('wait4(...) -> {pid='), 2)
+
+            # histograms are dumped on SIGUSR2 by a shell idle in epoll_wait
+            hist = os.path.join(tmpdir, 'hist')
+            env = dict(os.environ, LD_PRELOAD=LD_PRELOAD, TRACE_HIST=hist)
+            sh = subprocess.Popen(['./shell'], env=env, stdin=subprocess.PIPE,
+                                  stdout=subprocess.PIPE)
+            sh.stdin.write(b'true | cat\necho ready\n')
+            sh.stdin.flush()
+            self.assertEqual(sh.stdout.readline(), b'ready\n')
+            sh.send_signal(signal.SIGUSR2)
+            # children dump their own histograms when they exit
+            dump = '[%d] posix_spawn: count=2 ' % sh.pid
+            deadline = time.monotonic() + 5
+            while time.monotonic() < deadline:
+                with open(hist) as f:
+                    if dump in f.read():
+                        break
+                time.sleep(0.01)
+            with open(hist) as f:
+                self.assertIn(dump, f.read())
+            sh.stdin.close()
+            self.assertEqual(sh.wait(timeout=10), 0)
+
+    def test_compgen(self):
+        with TemporaryDirectory() as bindir:
+            os.symlink('/bin/true', os.path.join(bindir, 'shtest-a'))
+            # links are followed to check the target is an executable
+            os.symlink('/etc/passwd', os.path.join(bindir, 'shtest-p'))
+            os.symlink(bindir, os.path.join(bindir, 'shtest-d'))
+            # regular files must be executable, as when running a command
+            open(os.path.join(bindir, 'shtest-n'), 'w').close()
+            # new commands must be noticed by an index built before
+            script = ('compgen shtest-\n'
+                      'cp /bin/true {0}/shtest-b\n'
+                      'compgen shtest-\n').format(bindir).encode('utf-8')
+            env = dict(os.environ, PATH=bindir + ':' + os.environ['PATH'])
+            run = subprocess.run(['./shell'], input=script, timeout=10,
+                                 stdout=subprocess.PIPE, env=env)
+            self.assertEqual(run.stdout, b'shtest-a\nshtest-a\nshtest-b\n')
+
+    def test_timeout(self):
+        start = time.monotonic()
+        self.sendline('timeout 0.3 sleep 10 | cat')
+        self.expect_exact("timed out 'sleep 10 | cat'")
+        self.sendline('timeout 0.3 sleep 10 &')
+        self.expect_exact("[1] timed out 'sleep 10'")
+        self.sendline('jobs')
+        self.expect_exact("[1] killed 'sleep 10' by signal 15")
+        self.assertLess(time.monotonic() - start, 5)
+        self.sendline('timeout')
+        self.expect_exact('timeout: missing duration')
+        self.sendline('timeout 1x sleep 10')
+        self.expect_exact('timeout: 1x: invalid duration')
+
+    def test_history(self):
+        self.execute('echo first')
+        self.execute('echo second')
+        # history is shared with shells started later
+        self.sendline('quit')
+        self.child.expect(pexpect.EOF)
+        self.child.close()
+        self.child.logfile.close()
+        self.setUp()
+        self.sendline('history -s echo 2')
+        self.expect(r'\d+  history -s echo 2')
+        self.expect(r'\d+  echo second')
+        # patterns shorter than an indexed trigram
+        self.sendline('history -s fi 2')
+        self.expect(r'\d+  history -s fi 2')
+        self.expect(r'\d+  echo first')
+        self.sendline('history 5')
+        self.expect(r'\d+  echo second')
+        self.expect(r'\d+  history -s echo 2')
+        self.expect(r'\d+  history -s fi 2')
+        self.expect(r'\d+  history 5')
 
 class TestShellWithSyscalls(ShellTester, unittest.TestCase):
     def stty(self):
@@ -5,14 +5,26 @@
 
 #define DEBUG 0
 #include "shell.h"
-
-sigset_t sigchld_mask;
+#include "rio.h"
 
 static void sigint_handler(int sig) {
   /* No-op handler, we just need break read() call with EINTR. */
   (void)sig;
 }
 
+/* Exit status of a command that could not be started. */
+#define EXIT_NOTFOUND 127
+
+/* Convert wait status of a foreground job into an exit code, i.e. a small
+ * number that the shell reports to whoever invoked it. */
+static int exitstatus(int status) {
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  if (WIFSTOPPED(status))
+    return 128 + WSTOPSIG(status);
+  return WEXITSTATUS(status);
+}
+
 /* Rewrite closed file descriptors to -1,
  * to make sure we don't attempt do close them twice. */
 static void MaybeClose(int *fdp) {
@@ -22,100 +34,418 @@ static void MaybeClose(int *fdp) {
   *fdp = -1;
 }
 
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t *token, int ntokens, int *inputp, int *outputp) {
-  token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-  int n = 0;           /* number of tokens after redirections are removed */
+#define MAXREDIR 16 /* maximum number of redirections of a single command */
+
+/* Redirections of a command compiled into a plan for `spawn`. Files are
+ * opened by the shell, then the child performs descriptor moves in order. */
+typedef struct {
+  fdmove_t move[MAXREDIR];
+  bool opened[MAXREDIR]; /* source of the move is a file opened by shell */
+  int nmoves;
+  const char *coshut; /* `>&NAME-` target, i.e. coprocess to shut down */
+} redir_t;
+
+/* Shell doesn't need opened files once the child has been started. The
+ * command ran to completion if `writer` is 0, was started as job `writer`
+ * if positive, or did not run at all if negative. */
+static void close_redir(redir_t *rd, pid_t writer) {
+  for (int i = 0; i < rd->nmoves; i++)
+    if (rd->opened[i])
+      Close(rd->move[i].src);
+  rd->nmoves = 0;
+  if (rd->coshut && writer >= 0)
+    coprocshut(rd->coshut, writer);
+  rd->coshut = NULL;
+}
+
+/* Only standard descriptors and those redirected earlier in the command
+ * may be copied. Others belong to the shell, e.g. the terminal or files
+ * it opened for preceding redirections. */
+static bool dupsrc_p(redir_t *rd, int fd) {
+  if (fd <= STDERR_FILENO)
+    return true;
+  for (int i = 0; i < rd->nmoves; i++)
+    if (rd->move[i].fd == fd)
+      return true;
+  return false;
+}
+
+/* Opened file must not have a number of a descriptor that is replaced
+ * by an earlier move, since the child would copy the wrong file. */
+static int place_file(redir_t *rd, int fd) {
+  for (int i = 0; i < rd->nmoves; i++)
+    if (rd->move[i].fd == fd)
+      return movefd(fd);
+  return fd;
+}
+
+/* Consume all tokens related to redirection operators and compile them
+ * into a plan. Returns number of remaining tokens or -1 on error. */
+static int do_redir(token_t *token, int ntokens, redir_t *rd) {
+  int n = 0; /* number of tokens after redirections are removed */
+
+  rd->nmoves = 0;
+  rd->coshut = NULL;
 
   for (int i = 0; i < ntokens; i++) {
     /* TODO: Handle tokens and open files as requested. */
 #ifdef STUDENT
-    if (token[i] == T_INPUT) {
-      // if a token is a '<', we change mode
-      mode = T_INPUT;
-    } else if (token[i] == T_OUTPUT) {
-      // same with '>'
-      mode = T_OUTPUT;
-    } else if (mode) {
-      // if it is just a command part
-      if (mode == T_INPUT) {
-        // if an input was before the current token
-        MaybeClose(inputp);
-        // we close previous fds
-        *inputp = Open(token[i], O_RDONLY, 0);
-        // and we enable reading from fd
-        if (*inputp < 0)
-          app_error("ERROR: Cannot open input file %s!", token[i]);
-      } else if (mode == T_OUTPUT) {
-        // same with output
-        MaybeClose(outputp);
-        *outputp = Open(token[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (*outputp < 0)
-          app_error("ERROR: Cannot open output file %s!", token[i]);
+    int fd = -1;
+    if (token[i] == T_IONUM) {
+      // explicit descriptor number, e.g. 2>&1, is a single digit
+      fd = *token[i + 1] - '0';
+      i += 2;
+    }
+    token_t mode = token[i];
+    if (!redir_p(mode)) {
+      token[n++] = token[i];
+      // if a token was not redirection related, we keep it in array
+      continue;
+    }
+    if (i + 1 == ntokens || !string_p(token[i + 1])) {
+      msg("syntax error: missing redirection target\n");
+      goto fail;
+    }
+    if (rd->nmoves == MAXREDIR) {
+      msg("syntax error: too many redirections\n");
+      goto fail;
+    }
+    char *arg = token[++i];
+    if (fd < 0)
+      fd = (mode == T_INPUT || mode == T_DUPIN) ? STDIN_FILENO : STDOUT_FILENO;
+
+    bool opened = false;
+    int src;
+    if (mode == T_DUPIN || mode == T_DUPOUT) {
+      // n>&m makes a copy of m, n>&- closes n, n>&NAME connects n
+      // to coprocess NAME, n>&NAME- also shuts it down for writing
+      // when the command is done
+      if (!strcmp(arg, "-")) {
+        src = -1;
+      } else if (isdigit(arg[0]) && arg[1] == '\0' &&
+                 dupsrc_p(rd, arg[0] - '0')) {
+        src = arg[0] - '0';
+      } else if ((src = coprocfd(arg)) >= 0) {
+        // shell's end of coprocess channel stays open in the shell
+      } else if (mode == T_DUPOUT && (src = coprocshutfd(arg)) >= 0) {
+        rd->coshut = arg;
+      } else {
+        msg("%s: bad file descriptor\n", arg);
+        goto fail;
       }
-      mode = NULL;
-      // we reset mode after checking conditions
     } else {
-      token[n] = token[i];
-      // if a token was input/output related, we skip it in array
-      n++;
-      // and we increment the number of unrelated tokens
+      int flags = O_RDONLY;
+      if (mode == T_OUTPUT)
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+      else if (mode == T_APPEND)
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+      // opened files are never inherited unless the plan says so
+      if ((src = open(arg, flags | O_CLOEXEC, 0644)) < 0) {
+        msg("%s: %s\n", arg, strerror(errno));
+        goto fail;
+      }
+      src = place_file(rd, src);
+      opened = true;
     }
+    rd->opened[rd->nmoves] = opened;
+    rd->move[rd->nmoves++] = (fdmove_t){.fd = fd, .src = src};
 #endif /* !STUDENT */
   }
 
   token[n] = NULL;
   return n;
+
+fail:
+  close_redir(rd, -1);
+  return -1;
+}
+
+/* Shell's descriptor replaced for the time a builtin runs. */
+typedef struct {
+  int fd;    /* descriptor number */
+  int saved; /* copy of the original or -1 if it was not open */
+  int flags; /* original descriptor flags, i.e. FD_CLOEXEC */
+} fdsave_t;
+
+/* Put back descriptors saved by `apply_redir`. */
+static void restore_redir(fdsave_t *undo, int nundo) {
+  fflush(stdout);
+
+  for (int i = 0; i < nundo; i++) {
+    if (undo[i].saved < 0) {
+      (void)close(undo[i].fd);
+    } else {
+      Dup2(undo[i].saved, undo[i].fd);
+      (void)fcntl(undo[i].fd, F_SETFD, undo[i].flags);
+      Close(undo[i].saved);
+    }
+  }
+}
+
+/* Builtins run within the shell, so the plan is carried out on shell's own
+ * descriptors for the duration of the call. Replaced descriptors are saved
+ * in `undo` out of the way of redirections. Returns number of saved
+ * descriptors or -1 if the plan could not be applied. */
+static int apply_redir(redir_t *rd, fdsave_t *undo) {
+  int nundo = 0;
+
+  fflush(stdout);
+
+  for (int i = 0; i < rd->nmoves; i++) {
+    fdmove_t *m = &rd->move[i];
+    bool saved = false;
+    for (int j = 0; j < nundo; j++)
+      saved |= (undo[j].fd == m->fd);
+    if (!saved) {
+      /* Descriptor that was not open gets closed on restore. */
+      undo[nundo++] = (fdsave_t){
+        .fd = m->fd,
+        .saved = fcntl(m->fd, F_DUPFD_CLOEXEC, FD_PRIVATE),
+        .flags = fcntl(m->fd, F_GETFD),
+      };
+    }
+
+    if (m->src < 0) {
+      (void)close(m->fd);
+    } else if (m->src != m->fd && dup2(m->src, m->fd) < 0) {
+      msg("%d: %s\n", m->src, strerror(errno));
+      restore_redir(undo, nundo);
+      return -1;
+    }
+  }
+
+  return nundo;
+}
+
+/* Options of a job given as prefix words of a pipeline. */
+typedef struct {
+  unsigned timeout;   /* time limit [ms] or 0 if there is none */
+  unsigned killdelay; /* time [ms] between SIGTERM and SIGKILL */
+  bool contain;       /* start the job in its own cgroup */
+  const char *cpumax; /* percentage of a CPU the job may use or NULL */
+  const char *memmax; /* value for memory.max or NULL */
+  sched_t sched;      /* scheduling attributes of all job's processes */
+  const char *coproc; /* name of coprocess started by the job or NULL */
+} jobopts_t;
+
+/* Jobs with options cannot be run as builtins. */
+static bool plainjob_p(jobopts_t *opts) {
+  return !opts->timeout && !opts->contain && !opts->sched.setcpus &&
+         !opts->sched.setnice && !opts->sched.setioprio;
+}
+
+/* Parse duration given in seconds, optionally followed by a unit
+ * (s, m, h or d) like in timeout(1). Returns false if malformed. */
+static bool parse_duration(const char *s, unsigned *msecp) {
+  static const struct {
+    char unit;
+    double scale;
+  } units[] = {{'\0', 1}, {'s', 1}, {'m', 60}, {'h', 3600}, {'d', 86400}};
+  char *end;
+  double sec = strtod(s, &end);
+
+  if (end == s || sec < 0)
+    return false;
+  for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+    if (end[0] == units[i].unit && (end[0] == '\0' || end[1] == '\0')) {
+      *msecp = min(sec * units[i].scale * 1000, (double)UINT_MAX);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Parse share of a CPU given in percent. Returns false unless positive. */
+static bool parse_percent(const char *s) {
+  char *end;
+  double pct = strtod(s, &end);
+  return end != s && *end == '\0' && pct > 0;
+}
+
+/* Parse amount of memory in bytes, optionally followed by a suffix (K, M,
+ * G or T) as accepted by memory.max. Returns false unless positive. */
+static bool parse_bytes(const char *s) {
+  char *end;
+
+  if (!isdigit(s[0]))
+    return false;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (n == 0)
+    return false;
+  return end[0] == '\0' || (strchr("KMGT", end[0]) && end[1] == '\0');
+}
+
+/* Consume prefix words that set options of the job:
+ *  - timeout [-k DURATION] DURATION: terminate the job after DURATION,
+ *    kill it if still running after another DURATION given with -k,
+ *  - limit [-c PERCENT] [-m BYTES]: run the job in its own cgroup,
+ *    possibly restricted to PERCENT of a CPU and BYTES of memory,
+ *  - sched [-c CPULIST|auto] [-n INCREMENT] [-i CLASS[:LEVEL]]: set
+ *    scheduling attributes of all processes of the job, see sched.c,
+ *  - coproc NAME: run the job in background as a coprocess connected to
+ *    the shell, see coproc.c.
+ * Returns number of consumed tokens or -1 on error. */
+static int parse_jobopts(token_t *token, int ntokens, jobopts_t *opts) {
+  int i = 0;
+
+  *opts = (jobopts_t){.killdelay = killgrace()};
+
+  while (i < ntokens && string_p(token[i])) {
+    if (!strcmp(token[i], "timeout")) {
+      i++;
+      if (i + 1 < ntokens && string_p(token[i]) && !strcmp(token[i], "-k")) {
+        if (!string_p(token[i + 1])) {
+          msg("timeout: -k: missing duration\n");
+          return -1;
+        }
+        if (!parse_duration(token[i + 1], &opts->killdelay)) {
+          msg("timeout: %s: invalid duration\n", token[i + 1]);
+          return -1;
+        }
+        i += 2;
+      }
+      if (i == ntokens || !string_p(token[i])) {
+        msg("timeout: missing duration\n");
+        return -1;
+      }
+      if (!parse_duration(token[i], &opts->timeout)) {
+        msg("timeout: %s: invalid duration\n", token[i]);
+        return -1;
+      }
+      /* Zero duration disables the time limit like in timeout(1). */
+      i++;
+    } else if (!strcmp(token[i], "sched")) {
+      int k = parse_sched(token + i + 1, ntokens - i - 1, &opts->sched);
+      if (k < 0)
+        return -1;
+      i += k + 1;
+    } else if (!strcmp(token[i], "coproc")) {
+      if (i + 1 == ntokens || !string_p(token[i + 1]) ||
+          !coprocname_p(token[i + 1])) {
+        if (i + 1 < ntokens && string_p(token[i + 1]))
+          msg("coproc: %s: invalid name\n", token[i + 1]);
+        else
+          msg("coproc: missing name\n");
+        return -1;
+      }
+      opts->coproc = token[i + 1];
+      i += 2;
+    } else if (!strcmp(token[i], "limit")) {
+      opts->contain = true;
+      for (i++; i + 1 < ntokens && string_p(token[i]); i += 2) {
+        if (!strcmp(token[i], "-c"))
+          opts->cpumax = token[i + 1];
+        else if (!strcmp(token[i], "-m"))
+          opts->memmax = token[i + 1];
+        else
+          break;
+        if (!string_p(token[i + 1])) {
+          msg("limit: %s: missing value\n", token[i]);
+          return -1;
+        }
+        if (token[i][1] == 'c' ? !parse_percent(token[i + 1])
+                               : !parse_bytes(token[i + 1])) {
+          msg("limit: %s: invalid %s\n", token[i + 1],
+              token[i][1] == 'c' ? "percentage" : "size");
+          return -1;
+        }
+      }
+    } else {
+      break;
+    }
+  }
+
+  if (i > 0 && (i == ntokens || !string_p(token[i]))) {
+    msg("%s: missing command\n", token[0]);
+    return -1;
+  }
+  return i;
 }
 
 /* Execute internal command within shell's process or execute external command
  * in a subprocess. External command can be run in the background. */
-static int do_job(token_t *token, int ntokens, bool bg) {
-  int input = -1, output = -1;
+static int do_job(token_t *token, int ntokens, bool bg, jobopts_t *opts) {
+  redir_t rd;
   int exitcode = 0;
 
-  ntokens = do_redir(token, ntokens, &input, &output);
+  uint64_t start = phasestart();
+  ntokens = do_redir(token, ntokens, &rd);
+  phaseend(PH_REDIR, start);
+  if (ntokens < 0)
+    return EXIT_FAILURE;
 
-  if (!bg) {
-    if ((exitcode = builtin_command(token)) >= 0)
-      return exitcode;
+  /* Command consisting of redirections only merely creates files. */
+  if (ntokens == 0) {
+    close_redir(&rd, 0);
+    return exitcode;
   }
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  /* Builtins cannot be limited, so limited job runs a program instead. */
+  if (!bg && plainjob_p(opts) && builtin_p(token[0])) {
+    fdsave_t undo[MAXREDIR];
+    int nundo;
 
-  /* TODO: Start a subprocess, create a job and monitor it. */
-#ifdef STUDENT
-  pid_t pid = fork();
-  if (pid == 0) { // child process
-    Signal(SIGINT, SIG_DFL);
-    Signal(SIGTSTP, SIG_DFL);
-    Signal(SIGTTIN, SIG_DFL);
-    Signal(SIGTTOU, SIG_DFL);
-    Sigprocmask(SIG_SETMASK, &mask, NULL);
-    // default signal handlers
-    if (input != -1) {
-      // file descriptors handling
-      dup2(input, STDIN_FILENO);
-      Close(input);
+    if ((nundo = apply_redir(&rd, undo)) < 0) {
+      close_redir(&rd, -1);
+      return EXIT_FAILURE;
     }
-    if (output != -1) {
-      dup2(output, STDOUT_FILENO);
-      Close(output);
+    /* Time spent in nested phases, e.g. waiting for a job brought to
+     * foreground by `fg`, is not charged to the builtin. */
+    start = phasestart();
+    uint64_t nested = phasecharged();
+    exitcode = builtin_command(token);
+    if (exitcode >= 0)
+      phaseend(PH_BUILTIN, start + phasecharged() - nested);
+    restore_redir(undo, nundo);
+    if (exitcode >= 0) {
+      close_redir(&rd, 0);
+      return exitcode;
     }
-    external_command(token);
-    // we are in a subprocess, so we deal with external commands
+  }
+
+  /* TODO: Start a subprocess, create a job and monitor it. */
+#ifdef STUDENT
+  // coprocess reads from and writes to its end of the channel
+  int cofd = opts->coproc ? coprocopen(opts->coproc) : -1;
+  if (opts->coproc && cofd < 0) {
+    close_redir(&rd, -1);
+    return EXIT_FAILURE;
+  }
+  int cg = opts->contain ? cgcreate(opts->cpumax, opts->memmax) : 0;
+  spawn_t sp = {
+    .argv = token,
+    .pgid = 0,
+    .input = cofd,
+    .output = cofd,
+    .move = rd.move,
+    .nmoves = rd.nmoves,
+    .tty = bg ? -1 : ttyfd(),
+    .sched = &opts->sched,
+    .cgroup = cg,
+  };
+  pid_t pid = spawn(&sp);
+  // the child is already in its own process group and, if it runs
+  // in foreground, has taken over the terminal
+  close_redir(&rd, pid);
+  if (opts->coproc) {
+    Close(cofd);
+    coprocstarted(opts->coproc, max(pid, 0));
+  }
+  // redirected files are not needed by the shell anymore
+  if (pid < 0) {
+    exitcode = EXIT_NOTFOUND;
+    if (cg)
+      cgremove(cg);
   } else {
-    // parent process
-    setpgid(pid, pid);
-    // pid is now the leader of the group
-    int job = addjob(pid, bg);
+    int job = addjob(pid, bg, 1);
     // addjob
     addproc(job, pid, token);
+    setjobcgroup(job, cg);
     // and addproc like in the task
+    if (opts->timeout)
+      timeoutjob(job, opts->timeout, opts->killdelay);
     if (!bg) {
-      exitcode = monitorjob(&mask);
+      exitcode = exitstatus(monitorjob());
       // monitoring fg processes
     } else {
       msg("[%d] running '%s'\n", job, jobcmd(job));
@@ -124,160 +454,360 @@ static int do_job(token_t *token, int ntokens, bool bg) {
   }
 #endif /* !STUDENT */
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
 
 /* Start internal or external command in a subprocess that belongs to pipeline.
  * All subprocesses in pipeline must belong to the same process group. */
-static pid_t do_stage(pid_t pgid, sigset_t *mask, int input, int output,
-                      token_t *token, int ntokens, bool bg) {
-  ntokens = do_redir(token, ntokens, &input, &output);
+static pid_t do_stage(pid_t pgid, int input, int output, token_t *token,
+                      int ntokens, bool bg, const sched_t *sched, int cg,
+                      int *nsyscalls) {
+  redir_t rd;
 
-  if (ntokens == 0)
-    app_error("ERROR: Command line is not well formed!");
+  uint64_t start = phasestart();
+  ntokens = do_redir(token, ntokens, &rd);
+  phaseend(PH_REDIR, start);
 
   /* TODO: Start a subprocess and make sure it's moved to a process group. */
-  pid_t pid = Fork();
+  pid_t pid = -1;
 #ifdef STUDENT
-  if (pid == 0) { // child process
-    Signal(SIGINT, SIG_DFL);
-    Signal(SIGTSTP, SIG_DFL);
-    Signal(SIGTTIN, SIG_DFL);
-    Signal(SIGTTOU, SIG_DFL);
-    Sigprocmask(SIG_SETMASK, mask, NULL);
-    // signal handling
-    if (input != -1) {
-      // fd handling
-      dup2(input, STDIN_FILENO);
-      Close(input);
-    }
-    if (output != -1) {
-      dup2(output, STDOUT_FILENO);
-      Close(output);
-    }
-    setpgid(0, pgid);
-    // changing the leader of the group
-    external_command(token);
-    // subprocess, so external command
-  } else {
-    setpgid(pid, pgid);
-    // changing leader
-    MaybeClose(&input);
-    // closing descriptors to avoid leaks
-    MaybeClose(&output);
+  if (ntokens > 0) {
+    spawn_t sp = {
+      .argv = token,
+      .pgid = pgid,
+      .input = input,
+      .output = output,
+      .move = rd.move,
+      .nmoves = rd.nmoves,
+      .tty = (bg || pgid) ? -1 : ttyfd(),
+      .sched = sched,
+      .cgroup = cg,
+    };
+    // the first stage becomes the leader of the group
+    // and takes over the terminal if the pipeline runs in foreground
+    pid = spawn(&sp);
+    *nsyscalls += 1 + sp.nactions;
+    // each opened file costs an open and a close
+    for (int i = 0; i < rd.nmoves; i++)
+      *nsyscalls += 2 * rd.opened[i];
+    // the stage joins the group of the first one or becomes its leader
+    close_redir(&rd, (pid < 0 || pgid == 0) ? pid : pgid);
   }
+  *nsyscalls += (input >= 0) + (output >= 0);
+  MaybeClose(&input);
+  // closing descriptors to avoid leaks
+  MaybeClose(&output);
 #endif /* !STUDENT */
 
   return pid;
 }
 
-static void mkpipe(int *readp, int *writep) {
-  int fds[2];
-  Pipe(fds);
-  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
-  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
-  *readp = fds[0];
-  *writep = fds[1];
+/* Create all pipes connecting stages at once. Both ends are close-on-exec,
+ * so a child keeps only descriptors it received through redirection. */
+static void mkpipes(int *fds, int npipes) {
+  for (int i = 0; i < npipes; i++)
+    Pipe2(&fds[2 * i], O_CLOEXEC);
+}
+
+/* Command of a pipeline with its redirections. */
+typedef struct {
+  token_t *token; /* first token of the command */
+  int ntokens;    /* number of tokens up to next pipe operator */
+  int nprefix;    /* number of leading tokens that set `sched` */
+  sched_t sched;  /* scheduling attributes of the command */
+} stage_t;
+
+/* Number of commands connected with pipe operators. */
+static int count_stages(token_t *token, int ntokens) {
+  int nstages = 1;
+  for (int i = 0; i < ntokens; i++)
+    if (token[i] == T_PIPE)
+      nstages++;
+  return nstages;
+}
+
+/* Does the command have a name besides its redirections? */
+static bool command_p(token_t *token, int ntokens) {
+  for (int i = 0; i < ntokens; i++) {
+    if (token[i] == T_IONUM || redir_p(token[i]))
+      i++; /* skip descriptor number or redirection target */
+    else
+      return true;
+  }
+  return false;
+}
+
+/* Attributes given with `sched` in front of the stage override those of the
+ * job. Returns false if they are malformed. */
+static bool plan_stage(stage_t *st, const sched_t *sched) {
+  st->sched = *sched;
+  st->nprefix = 0;
+  if (!string_p(st->token[0]) || strcmp(st->token[0], "sched"))
+    return true;
+
+  int k = parse_sched(st->token + 1, st->ntokens - 1, &st->sched);
+  if (k < 0)
+    return false;
+  st->nprefix = k + 1;
+  return true;
+}
+
+/* Split tokens into stages in a single pass. Returns false if a stage has
+ * malformed attributes or no command, which is checked before anything gets
+ * started, so that a pipeline either runs as a whole or not at all. */
+static bool plan_pipeline(token_t *token, int ntokens, stage_t *stage,
+                          const sched_t *sched) {
+  int nstages = 0;
+
+  stage[0].token = token;
+  for (int i = 0; i < ntokens; i++) {
+    if (token[i] == T_PIPE) {
+      stage[nstages].ntokens = token + i - stage[nstages].token;
+      stage[++nstages].token = token + i + 1;
+    }
+  }
+  stage[nstages].ntokens = token + ntokens - stage[nstages].token;
+
+  for (int i = 0; i <= nstages; i++) {
+    stage_t *st = &stage[i];
+    if (!plan_stage(st, sched))
+      return false;
+    if (!command_p(st->token + st->nprefix, st->ntokens - st->nprefix)) {
+      if (st->nprefix)
+        msg("sched: missing command\n");
+      else
+        msg("syntax error: missing command in pipeline\n");
+      return false;
+    }
+  }
+  return true;
 }
 
 /* Pipeline execution creates a multiprocess job. Both internal and external
  * commands are executed in subprocesses. */
-static int do_pipeline(token_t *token, int ntokens, bool bg) {
+static int do_pipeline(token_t *token, int ntokens, int nstages, bool bg,
+                       jobopts_t *opts) {
   pid_t pid, pgid = 0;
   int job = -1;
   int exitcode = 0;
 
-  int input = -1, output = -1, next_input = -1;
-
-  mkpipe(&next_input, &output);
+  stage_t stage[nstages];
+  if (!plan_pipeline(token, ntokens, stage, &opts->sched))
+    return 2;
+  /* System calls and file actions it takes to set up the pipeline. */
+  int nsyscalls = nstages - 1;
+
+  /* Coprocess channel is input of the first and output of the last stage. */
+  int coin = -1, coout = -1;
+  if (opts->coproc) {
+    if ((coin = coprocopen(opts->coproc)) < 0)
+      return EXIT_FAILURE;
+    if ((coout = fcntl(coin, F_DUPFD_CLOEXEC, 0)) < 0)
+      unix_error("fcntl error");
+  }
 
-  sigset_t mask;
-  Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+  /* Pipe between stages i and i+1 is { pipefd[2*i], pipefd[2*i+1] }. */
+  int pipefd[2 * (nstages - 1)];
+  mkpipes(pipefd, nstages - 1);
 
   /* TODO: Start pipeline subprocesses, create a job and monitor it.
    * Remember to close unused pipe ends! */
 #ifdef STUDENT
-  int index_in_token = 0;
-  // where are we in token array
-  int index_in_part = 0;
-  // where are we in a pipe part
-  int i = 0;
-  while (i < ntokens) {
-    if (token[i] == T_PIPE) {
-      // if a token is a '|'
-      pid = do_stage(pgid, &mask, input, output, token + index_in_token,
-                     index_in_part, bg);
-      // create a pipe stage
-      if (job == -1) {
-        // if this is the first process
-        pgid = pid;
-        job = addjob(pgid, bg);
-      }
-      addproc(job, pid, token + index_in_token);
-      input = next_input;
-      // preparing to create next pipe
-      mkpipe(&next_input, &output);
-      // creating next pipe
-      index_in_part = 0;
-      // reset to beginning of the next part
-      index_in_token = i + 1;
-      // where are we in the token array
-    } else if (i == ntokens - 1 ||
-               (i == ntokens - 2 && token[ntokens - 1] == T_BGJOB)) {
-      // if the last part
-      Close(next_input);
-      // closing descriptors
-      Close(output);
-      output = -1;
-      pid = do_stage(pgid, &mask, input, output, token + index_in_token,
-                     index_in_part + 1, bg);
-      // create last stage
-      addproc(job, pid, token + index_in_token);
-      // add it
-    } else {
-      index_in_part++;
-      // if just a command, move on
+  // all stages are started in the job's cgroup
+  int cg = opts->contain ? cgcreate(opts->cpumax, opts->memmax) : 0;
+  for (int i = 0; i < nstages; i++) {
+    int input = (i > 0) ? pipefd[2 * i - 2] : coin;
+    int output = (i < nstages - 1) ? pipefd[2 * i + 1] : coout;
+    // stage reads from previous pipe and writes to next one,
+    // do_stage closes both ends in the shell once the child is started
+    stage_t *st = &stage[i];
+    pid = do_stage(pgid, input, output, st->token + st->nprefix,
+                   st->ntokens - st->nprefix, bg, &st->sched, cg,
+                   &nsyscalls);
+    if (pid < 0)
+      continue;
+    if (job == -1) {
+      // first process that started becomes the leader of the group
+      pgid = pid;
+      job = addjob(pgid, bg, nstages);
     }
-    i++;
+    addproc(job, pid, stage[i].token);
+  }
+  pipelinestats(nsyscalls);
+  if (cg) {
+    if (job >= 0)
+      setjobcgroup(job, cg);
+    else
+      cgremove(cg);
   }
-  if (!bg) {
-    exitcode = monitorjob(&mask);
+  if (job >= 0 && opts->timeout)
+    timeoutjob(job, opts->timeout, opts->killdelay);
+  if (opts->coproc)
+    coprocstarted(opts->coproc, pgid);
+  if (job == -1) {
+    exitcode = EXIT_NOTFOUND;
+  } else if (!bg) {
+    exitcode = exitstatus(monitorjob());
+    // status of a pipeline is that of its last command
+    if (pid < 0)
+      exitcode = EXIT_NOTFOUND;
   }
 #endif /* !STUDENT */
 
-  Sigprocmask(SIG_SETMASK, &mask, NULL);
   return exitcode;
 }
 
-static bool is_pipeline(token_t *token, int ntokens) {
-  for (int i = 0; i < ntokens; i++)
-    if (token[i] == T_PIPE)
-      return true;
-  return false;
+/* Pipeline ends at first list operator, i.e. ;, &, && or ||. */
+static int pipeline_length(token_t *token, int ntokens) {
+  int n = 0;
+  while (n < ntokens && (token[n] == T_PIPE || !separator_p(token[n])))
+    n++;
+  return n;
+}
+
+/* Check that each pipeline in the list and each command in a pipeline is
+ * non-empty, and that ! only appears in front of a pipeline. */
+static bool check_syntax(token_t *token, int ntokens) {
+  for (int i = 0; i < ntokens; i++) {
+    while (i < ntokens && token[i] == T_BANG)
+      i++;
+    int n = pipeline_length(token + i, ntokens - i);
+    if (n == 0 || token[i] == T_PIPE || token[i + n - 1] == T_PIPE)
+      return false;
+    for (int k = i; k < i + n; k++)
+      if (token[k] == T_BANG || (token[k] == T_PIPE && token[k + 1] == T_PIPE))
+        return false;
+    i += n;
+    /* Only && and || require something to follow them. */
+    if (i < ntokens && (token[i] == T_AND || token[i] == T_OR) &&
+        i == ntokens - 1)
+      return false;
+  }
+  return true;
 }
 
-static void eval(char *cmdline) {
-  bool bg = false;
+/* Execute a list of pipelines separated by ;, &, && or || operators, each
+ * possibly preceded by !. Operators && and || have equal precedence and are
+ * evaluated left to right with short-circuiting, so in `a || b && c` command
+ * `c` runs if either `a` or `b` succeeded. Operator & puts only the pipeline
+ * just before it into background. Returns exit code of the last pipeline
+ * that was executed. */
+static int eval(char *cmdline) {
+  int exitcode = 0;
+  bool skip = false; /* next pipeline is short-circuited */
   int ntokens;
+  uint64_t start = phasestart();
   token_t *token = tokenize(cmdline, &ntokens);
+  phaseend(PH_TOKENIZE, start);
 
-  if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-    token[--ntokens] = NULL;
-    bg = true;
+  if (!check_syntax(token, ntokens)) {
+    msg("syntax error\n");
+    return 2;
   }
 
-  if (ntokens > 0) {
-    if (is_pipeline(token, ntokens)) {
-      do_pipeline(token, ntokens, bg);
-    } else {
-      do_job(token, ntokens, bg);
+  for (int i = 0; i < ntokens; i++) {
+    bool negate = false;
+    for (; token[i] == T_BANG; i++)
+      negate = !negate;
+
+    int n = pipeline_length(token + i, ntokens - i);
+    token_t op = (i + n < ntokens) ? token[i + n] : T_NULL;
+    bool bg = (op == T_BGJOB);
+
+    if (!skip) {
+      /* Operator gets overwritten to terminate the pipeline. */
+      token[i + n] = NULL;
+      jobopts_t opts;
+      int k = parse_jobopts(token + i, n, &opts);
+      if (k < 0) {
+        exitcode = 125;
+      } else {
+        /* Coprocess always runs in background. */
+        bg = bg || opts.coproc;
+        int nstages = count_stages(token + i + k, n - k);
+        if (nstages > 1) {
+          exitcode = do_pipeline(token + i + k, n - k, nstages, bg, &opts);
+        } else {
+          exitcode = do_job(token + i + k, n - k, bg, &opts);
+        }
+      }
+      if (negate)
+        exitcode = !exitcode;
     }
+
+    if (op == T_AND)
+      skip = (exitcode != 0);
+    else if (op == T_OR)
+      skip = (exitcode == 0);
+    else
+      skip = false;
+
+    i += n;
   }
 
-  free(token);
+  return exitcode;
 }
 
+static void input_ready(void *arg) {
+  *(bool *)arg = true;
+}
+
+#define REPORT_DELAY 200 /* time [ms] given to input typed ahead */
+
+static void report_jobs(void *arg) {
+  event_t **evp = arg;
+  evcancel(*evp);
+  *evp = NULL;
+  watchjobs(FINISHED, false);
+}
+
+/* Keep the event loop running (e.g. reap background jobs that changed their
+ * state) until there is something to read from the terminal. Jobs that
+ * finish while the shell is idle get reported without waiting for the next
+ * command, e.g. ones killed by a command that has just returned. Commands
+ * typed ahead run first, so their output is not preceded by the report.
+ * Returns false if the wait was interrupted by a signal. */
+static bool wait_for_input(int fd) {
+  bool ready = false;
+  event_t *report = NULL;
+  event_t *ev = evwatch(fd, input_ready, &ready);
+  while (!ready && evwait())
+    if (!ready && report == NULL && finishedjobs())
+      report = evtimer(REPORT_DELAY, report_jobs, &report);
+  evcancel(report);
+  evcancel(ev);
+  if (!ready)
+    errno = EINTR;
+  return ready;
+}
+
+#ifdef READLINE
+static int getc_event(FILE *stream) {
+  (void)wait_for_input(fileno(stream));
+  return rl_getc(stream);
+}
+
+static char *complete_command(const char *text, int state) {
+  static char **names;
+  static size_t count, next;
+
+  if (state == 0) {
+    names = complete(text, &count);
+    next = 0;
+  }
+  return (next < count) ? strdup(names[next++]) : NULL;
+}
+
+/* First word of the line is completed from commands in $PATH, the other
+ * words with readline's default file name completion. */
+static char **complete_line(const char *text, int start, int end) {
+  (void)end;
+  if (start > 0)
+    return NULL;
+  return rl_completion_matches(text, complete_command);
+}
+#endif
+
 #ifndef READLINE
 static char *readline(const char *prompt) {
   static char line[MAXLINE]; /* `readline` is clearly not reentrant! */
@@ -286,7 +816,9 @@ static char *readline(const char *prompt) {
 
   line[0] = '\0';
 
-  ssize_t nread = read(STDIN_FILENO, line, MAXLINE);
+  ssize_t nread = -1;
+  if (wait_for_input(STDIN_FILENO))
+    nread = read(STDIN_FILENO, line, MAXLINE);
   if (nread < 0) {
     if (errno != EINTR)
       unix_error("Read error");
@@ -302,22 +834,106 @@ static char *readline(const char *prompt) {
 }
 #endif
 
+/* Execute a line of a script. Blank lines and comments, in particular "#!"
+ * line of an executable script, leave exit code of previous command. */
+static int run_line(char *line, int exitcode) {
+  line[strcspn(line, "\n")] = '\0';
+  line += strspn(line, " \t\v\f\r");
+  if (line[0] == '\0' || line[0] == '#')
+    return exitcode;
+  exitcode = eval(line);
+  watchjobs(FINISHED, false);
+  return exitcode;
+}
+
+/* Commands read the rest of the script from standard input, so the shell
+ * must not keep what it read ahead. The buffered part of a seekable input is
+ * put back like dash does. */
+static void unread_script(rio_t *rio) {
+  if (rio->rio_cnt > 0 && lseek(rio->rio_fd, -rio->rio_cnt, SEEK_CUR) >= 0)
+    rio_readinitb(rio, rio->rio_fd);
+}
+
+/* Execute commands read from `fd` back to back, without prompting.
+ * Returns exit code of the last command. */
+static int run_script(int fd) {
+  static rio_t rio;
+  static strbuf_t line;
+  char piece[MAXLINE];
+  int exitcode = 0;
+  ssize_t n;
+
+  /* A script given by name is not shared with the commands it runs, and
+   * a pipe cannot be rewound. */
+  bool shared = fd == STDIN_FILENO && lseek(fd, 0, SEEK_CUR) >= 0;
+
+  rio_readinitb(&rio, fd);
+
+  while ((n = Rio_readlineb(&rio, piece, MAXLINE)) > 0) {
+    sbappend(&line, piece);
+    /* Longer lines are read in pieces, the last one ends with newline. */
+    if (n == MAXLINE - 1 && piece[n - 1] != '\n')
+      continue;
+    if (shared)
+      unread_script(&rio);
+    exitcode = run_line(line.data, exitcode);
+    sbreset(&line);
+  }
+  /* Last line may be missing its newline. */
+  if (line.len > 0) {
+    exitcode = run_line(line.data, exitcode);
+    sbreset(&line);
+  }
+
+  return exitcode;
+}
+
+/* Run commands given with -c option, from a script or a pipe. There's no
+ * prompt and no job control, but foreground jobs get the terminal. */
+static int batch(int argc, char *argv[]) {
+  bool cflag = argc > 1 && !strcmp(argv[1], "-c");
+  int exitcode, fd = STDIN_FILENO;
+
+  if (cflag && argc < 3)
+    app_error("Usage: %s [-c command | script]", argv[0]);
+  if (argc > 1 && !cflag)
+    fd = Open(argv[1], O_RDONLY | O_CLOEXEC, 0);
+
+  /* Job reports must not get behind output of commands run afterwards. */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  initevents();
+  initjobs(false);
+
+  if (cflag)
+    exitcode = eval(argv[2]);
+  else
+    exitcode = run_script(fd);
+
+  shutdownjobs();
+
+  return exitcode;
+}
+
 int main(int argc, char *argv[]) {
-  /* `stdin` should be attached to terminal running in canonical mode */
-  if (!isatty(STDIN_FILENO))
-    app_error("ERROR: Shell can run only in interactive mode!");
+  /* Interactive mode requires `stdin` attached to terminal running in
+   * canonical mode, otherwise commands are executed in batch mode. */
+  if (argc > 1 || !isatty(STDIN_FILENO))
+    return batch(argc, argv);
 
 #ifdef READLINE
   rl_initialize();
+  rl_getc_function = getc_event;
+  rl_attempted_completion_function = complete_line;
 #endif
 
-  sigemptyset(&sigchld_mask);
-  sigaddset(&sigchld_mask, SIGCHLD);
+  initevents();
 
   if (getsid(0) != getpgid(0))
     Setpgid(0, 0);
 
-  initjobs();
+  initjobs(true);
+  inithistory();
 
   struct sigaction act = {
     .sa_handler = sigint_handler,
@@ -339,10 +955,11 @@ int main(int argc, char *argv[]) {
 #ifdef READLINE
       add_history(line);
 #endif
+      histadd(line);
       eval(line);
     }
     free(line);
-    watchjobs(FINISHED);
+    watchjobs(FINISHED, false);
   }
 
   msg("\n");
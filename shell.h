@@ -22,11 +22,25 @@ typedef char *token_t;
 #define T_OUTPUT ((token_t)6)
 #define T_INPUT ((token_t)7)
 #define T_APPEND ((token_t)8)
-#define T_BANG ((token_t)9)
+#define T_DUPOUT ((token_t)9)
+#define T_DUPIN ((token_t)10)
+#define T_BANG ((token_t)11)
+#define T_IONUM ((token_t)12) /* next token is descriptor to redirect */
 #define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+#define redir_p(t) ((t) >= T_OUTPUT && (t) <= T_DUPIN)
+#define string_p(t) ((t) > T_IONUM)
+
+/* Growable string, that is empty when zero-initialized. */
+typedef struct {
+  char *data;  /* NUL-terminated contents or NULL */
+  size_t len;  /* length of the string */
+  size_t size; /* size of the buffer */
+} strbuf_t;
+
+void sbreserve(strbuf_t *sb, size_t n);
+void sbappend(strbuf_t *sb, const char *src);
+void sbreset(strbuf_t *sb);
 
-void strapp(char **dstp, const char *src);
 token_t *tokenize(char *s, int *tokc_p);
 
 /* Do not change those values or code will break! */
@@ -43,23 +57,132 @@ enum {
   STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
+void initjobs(bool interactive);
 void shutdownjobs(void);
 
-int addjob(pid_t pgid, int bg);
+int addjob(pid_t pgid, int bg, int nproc);
 void addproc(int job, pid_t pid, char **argv);
 bool killjob(int job);
-void watchjobs(int state);
+unsigned killgrace(void);
+void timeoutjob(int job, unsigned msec, unsigned killdelay);
+void setjobcgroup(int job, int cg);
+void watchjobs(int state, bool verbose);
+bool finishedjobs(void);
 char *jobcmd(int job);
-bool resumejob(int job, int bg, sigset_t *mask);
-int monitorjob(sigset_t *mask);
+bool resumejob(int job, int bg);
+int monitorjob(void);
 
 void setfgpgrp(pid_t pgid);
+int ttyfd(void);
+
+/* Descriptor `fd` of a subprocess becomes a copy of shell's descriptor `src`
+ * or gets closed if `src` is -1. */
+typedef struct {
+  int fd;
+  int src;
+} fdmove_t;
+
+#define MAXCPU 1024 /* highest CPU number that can be used in affinity + 1 */
+#define CPUWORDS (MAXCPU / (8 * sizeof(unsigned long)))
+
+/* Scheduling attributes of a job or its stage, all are optional. */
+typedef struct {
+  bool setcpus;                  /* CPU affinity is set */
+  bool autocpu;                  /* pick a single CPU in round robin way */
+  unsigned long cpus[CPUWORDS];  /* bitmap of CPUs the process may run on */
+  bool setnice;                  /* nice level is changed */
+  int nice;                      /* increment of shell's nice level */
+  bool setioprio;                /* I/O priority is set */
+  int ioprio;                    /* I/O scheduling class and level */
+} sched_t;
+
+int parse_sched(token_t *token, int ntokens, sched_t *sc);
+void schedrun(const sched_t *sc, void (*fn)(void *), void *arg);
 
+/* Description of a subprocess to be started by `spawn`. */
+typedef struct {
+  char **argv;    /* command name and its arguments */
+  pid_t pgid;     /* process group to join, 0 to create a new one */
+  int input;      /* file descriptor to become stdin or -1 */
+  int output;     /* file descriptor to become stdout or -1 */
+  fdmove_t *move; /* redirections applied after input & output, in order */
+  int nmoves;     /* number of redirections */
+  int tty;        /* terminal to take over before execve or -1 */
+  const sched_t *sched; /* scheduling attributes or NULL */
+  int cgroup;     /* job's cgroup to start in or 0 */
+  int nactions;   /* set by spawn: file actions the child performed */
+} spawn_t;
+
+pid_t spawn(spawn_t *sp);
+
+bool builtin_p(const char *name);
 int builtin_command(char **argv);
 noreturn void external_command(char **argv);
 
-/* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
-extern sigset_t sigchld_mask;
+const char *hashcmd(const char *name);
+void hashdel(const char *name);
+void hashclear(void);
+void hashlist(void);
+
+void inithistory(void);
+void histadd(const char *line);
+void histlist(size_t n);
+void histsearch(const char *pattern, size_t n);
+
+char **complete(const char *prefix, size_t *countp);
+
+int cgcreate(const char *cpu, const char *mem);
+void cgfini(void);
+int cgopen(int cg);
+bool cgkill(int cg);
+void cgremove(int cg);
+const char *cgusage(int cg);
+
+bool coprocname_p(const char *name);
+int coprocfd(const char *name);
+int coprocshutfd(const char *arg);
+void coprocshut(const char *arg, pid_t writer);
+int coprocopen(const char *name);
+void coprocstarted(const char *name, pid_t pgid);
+void coprocclose(pid_t pgid);
+
+typedef struct event event_t;
+typedef void (*evfunc_t)(void *arg);
+
+/* Descriptors from FD_PRIVATE up are used by the shell itself. */
+#define FD_PRIVATE 10
+
+int movefd(int fd);
+
+void initevents(void);
+event_t *evwatch(int fd, evfunc_t func, void *arg);
+event_t *evtimer(unsigned msec, evfunc_t func, void *arg);
+event_t *evsignal(int sig, evfunc_t func, void *arg);
+void evcancel(event_t *ev);
+bool evwait(void);
+void evcheck(void);
+
+/* Phases of command execution measured by phase timers. */
+enum {
+  PH_TOKENIZE, /* splitting command line into tokens */
+  PH_REDIR,    /* compiling redirections and opening files */
+  PH_BUILTIN,  /* running a builtin command */
+  PH_LOOKUP,   /* finding executable in $PATH */
+  PH_SPAWN,    /* creating subprocess until it executes the program */
+  PH_TTY,      /* passing terminal between shell and foreground job */
+  PH_WAIT,     /* waiting for foreground job to finish or stop */
+  PH_COMPLETE, /* looking up completions of a command name */
+  NPHASES
+};
+
+uint64_t phasestart(void);
+void phaseend(int phase, uint64_t start);
+uint64_t phasecharged(void);
+void pipelinestats(int nsyscalls);
+void resetstats(void);
+void showstats(void);
+
+/* Signal mask the shell was started with, restored in its subprocesses. */
+extern sigset_t child_mask;
 
 #endif /* !_SHELL_H_ */
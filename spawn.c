@@ -0,0 +1,283 @@
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <linux/close_range.h>
+#include <linux/sched.h>
+#include "shell.h"
+
+/* glibc extensions (since 2.35) that <spawn.h> only declares with
+ * _GNU_SOURCE, which in turn clashes with declarations in csapp.h. */
+int posix_spawn_file_actions_addtcsetpgrp_np(posix_spawn_file_actions_t *fa,
+                                             int tcfd);
+int posix_spawn_file_actions_addclosefrom_np(posix_spawn_file_actions_t *fa,
+                                             int from);
+
+/* Start an external command described by `sp` without copying the shell's
+ * address space. posix_spawn(3) creates the child with CLONE_VM|CLONE_VFORK,
+ * so its cost does not depend on how much memory the shell has mapped.
+ * The child gets the same setup as a forked subprocess used to have:
+ * default dispositions of job control signals, original signal mask,
+ * redirected descriptors and a process group of the job. File actions are
+ * a compiled redirection plan: descriptor moves applied in order and then
+ * a close_range(2) over all descriptors the child was not given.
+ * Scheduling attributes come from the thread that spawns, see sched.c.
+ *
+ * posix_spawn cannot start the child in another cgroup, and the shell must
+ * not enter a job's cgroup itself, or pages it touches meanwhile would be
+ * charged to the job and the job's OOM killer could pick the shell. So
+ * processes of contained jobs are created with clone3(2) and
+ * CLONE_INTO_CGROUP instead. That copies the shell's page tables like
+ * fork(2) did, after which the child performs the same setup as above with
+ * plain system calls. */
+
+/* Signals the child gets default dispositions of, as the shell handles or
+ * ignores them for the sake of job control. */
+static void setup_sigdef(sigset_t *sigdef) {
+  sigemptyset(sigdef);
+  sigaddset(sigdef, SIGINT);
+  sigaddset(sigdef, SIGTSTP);
+  sigaddset(sigdef, SIGTTIN);
+  sigaddset(sigdef, SIGTTOU);
+}
+
+static void setup_attr(posix_spawnattr_t *attr, spawn_t *sp) {
+  sigset_t sigdef;
+
+  setup_sigdef(&sigdef);
+
+  posix_spawnattr_init(attr);
+  posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF |
+                                   POSIX_SPAWN_SETSIGMASK |
+                                   POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setsigdefault(attr, &sigdef);
+  posix_spawnattr_setsigmask(attr, &child_mask);
+  posix_spawnattr_setpgroup(attr, sp->pgid);
+}
+
+/* Returns the number of file actions. */
+static int setup_actions(posix_spawn_file_actions_t *fa, spawn_t *sp) {
+  unsigned keep = 7; /* bitmap of descriptors left to the child */
+  int maxfd = STDERR_FILENO;
+  int n = 0;
+
+  posix_spawn_file_actions_init(fa);
+
+  /* Process group is already set when file actions are performed,
+   * so the child can take over the terminal before it calls execve.
+   * Do it first, since redirections may reuse terminal's descriptor. */
+  if (sp->tty >= 0) {
+    posix_spawn_file_actions_addtcsetpgrp_np(fa, sp->tty);
+    n++;
+  }
+
+  if (sp->input >= 0 && sp->input != STDIN_FILENO) {
+    posix_spawn_file_actions_adddup2(fa, sp->input, STDIN_FILENO);
+    n++;
+  }
+  if (sp->output >= 0 && sp->output != STDOUT_FILENO) {
+    posix_spawn_file_actions_adddup2(fa, sp->output, STDOUT_FILENO);
+    n++;
+  }
+
+  for (int i = 0; i < sp->nmoves; i++) {
+    fdmove_t *m = &sp->move[i];
+    n++;
+    if (m->src < 0) {
+      posix_spawn_file_actions_addclose(fa, m->fd);
+      keep &= ~(1 << m->fd);
+    } else {
+      posix_spawn_file_actions_adddup2(fa, m->src, m->fd);
+      keep |= 1 << m->fd;
+      maxfd = max(maxfd, m->fd);
+    }
+  }
+
+  /* Finally get rid of everything else, i.e. descriptors that were sources
+   * of redirections and any descriptor that is not close-on-exec. */
+  for (int fd = STDERR_FILENO + 1; fd <= maxfd; fd++) {
+    if (!(keep & (1 << fd))) {
+      posix_spawn_file_actions_addclose(fa, fd);
+      n++;
+    }
+  }
+  posix_spawn_file_actions_addclosefrom_np(fa, maxfd + 1);
+  return n + 1;
+}
+
+/* Make `fd` a copy of `src` that is inherited across execve. */
+static int child_dup2(int src, int fd) {
+  if (src == fd)
+    return fcntl(fd, F_SETFD, 0);
+  return dup2(src, fd);
+}
+
+/* Child side of clone_spawn: what posix_spawn does with the attributes and
+ * file actions set up above. All signals are blocked on entry, so none of
+ * the shell's handlers can run here. Failure is reported through `errfd`. */
+static noreturn void child_exec(spawn_t *sp, const char *path, int errfd) {
+  struct sigaction dfl = {.sa_handler = SIG_DFL}, sa;
+  sigset_t sigdef;
+  unsigned keep = 7; /* bitmap of descriptors left to the child */
+  int maxfd = STDERR_FILENO;
+
+  setup_sigdef(&sigdef);
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigaction(sig, NULL, &sa) == 0 &&
+        (sa.sa_handler != SIG_IGN || sigismember(&sigdef, sig)))
+      (void)sigaction(sig, &dfl, NULL);
+
+  if (setpgid(0, sp->pgid) < 0)
+    goto fail;
+  if (sp->tty >= 0 && tcsetpgrp(sp->tty, getpgrp()) < 0)
+    goto fail;
+
+  if (sp->input >= 0 && sp->input != STDIN_FILENO &&
+      dup2(sp->input, STDIN_FILENO) < 0)
+    goto fail;
+  if (sp->output >= 0 && sp->output != STDOUT_FILENO &&
+      dup2(sp->output, STDOUT_FILENO) < 0)
+    goto fail;
+
+  for (int i = 0; i < sp->nmoves; i++) {
+    fdmove_t *m = &sp->move[i];
+    if (m->src < 0) {
+      (void)close(m->fd);
+      keep &= ~(1 << m->fd);
+    } else {
+      if (child_dup2(m->src, m->fd) < 0)
+        goto fail;
+      keep |= 1 << m->fd;
+      maxfd = max(maxfd, m->fd);
+    }
+  }
+
+  for (int fd = STDERR_FILENO + 1; fd <= maxfd; fd++)
+    if (!(keep & (1 << fd)))
+      (void)close(fd);
+  /* Closed by execve, so that `errfd` stays open until then. */
+  (void)syscall(SYS_close_range, maxfd + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+
+  sigprocmask(SIG_SETMASK, &child_mask, NULL);
+  (void)execve(path, sp->argv, environ);
+
+fail:;
+  int err = errno;
+  (void)write(errfd, &err, sizeof(err));
+  _exit(127);
+}
+
+/* Start the process in the cgroup opened as `cgfd`. Like posix_spawn,
+ * returns 0 or an error number, which covers failure of execve too. */
+static int clone_spawn(pid_t *pidp, const char *path, spawn_t *sp,
+                       int cgfd) {
+  struct clone_args args = {
+    .flags = CLONE_INTO_CGROUP,
+    .exit_signal = SIGCHLD,
+    .cgroup = cgfd,
+  };
+  sigset_t all, mask;
+  int fds[2], err = 0;
+
+  /* Redirections only target single digit descriptors, so the child does
+   * not overwrite one numbered 10 or above. */
+  Pipe2(fds, O_CLOEXEC);
+  int errfd = fcntl(fds[1], F_DUPFD_CLOEXEC, 10);
+  Close(fds[1]);
+  if (errfd < 0) {
+    err = errno;
+    Close(fds[0]);
+    return err;
+  }
+
+  sigfillset(&all);
+  Sigprocmask(SIG_SETMASK, &all, &mask);
+  pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+  if (pid == 0)
+    child_exec(sp, path, errfd);
+  if (pid < 0)
+    err = errno;
+  Sigprocmask(SIG_SETMASK, &mask, NULL);
+  Close(errfd);
+
+  /* End of file means the child got to execve. */
+  if (pid > 0) {
+    ssize_t n;
+    while ((n = read(fds[0], &err, sizeof(err))) < 0 && errno == EINTR)
+      continue;
+    if (n == sizeof(err))
+      (void)waitpid(pid, NULL, 0);
+    else
+      err = 0;
+  }
+  Close(fds[0]);
+
+  *pidp = pid;
+  return err;
+}
+
+typedef struct {
+  spawn_t *sp;
+  const char *path;
+  bool hashed;
+  int cgfd; /* cgroup to start the process in or -1 */
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  pid_t pid;
+  int err;
+} spawncall_t;
+
+static int start_process(spawncall_t *call) {
+  if (call->cgfd >= 0)
+    return clone_spawn(&call->pid, call->path, call->sp, call->cgfd);
+  return posix_spawn(&call->pid, call->path, &call->fa, &call->attr,
+                     call->sp->argv, environ);
+}
+
+static void do_spawn(void *arg) {
+  spawncall_t *call = arg;
+  const char *name = call->sp->argv[0];
+
+  uint64_t start = phasestart();
+  call->err = start_process(call);
+  phaseend(PH_SPAWN, start);
+  if (call->err == ENOENT && call->hashed) {
+    /* Remembered location is stale, search the PATH once more. */
+    hashdel(name);
+    if ((call->path = hashcmd(name)))
+      call->err = start_process(call);
+  }
+}
+
+/* Returns pid of the new process or -1 if it could not be started,
+ * in which case an error message was already printed. */
+pid_t spawn(spawn_t *sp) {
+  const char *name = sp->argv[0];
+  spawncall_t call = {
+    .sp = sp, .path = name, .hashed = !index(name, '/'), .cgfd = -1};
+
+  uint64_t start = phasestart();
+  if (call.hashed)
+    call.path = hashcmd(name);
+  phaseend(PH_LOOKUP, start);
+  if (call.path == NULL) {
+    msg("%s: %s\n", name, strerror(ENOENT));
+    return -1;
+  }
+
+  if (sp->cgroup && (call.cgfd = cgopen(sp->cgroup)) < 0)
+    return -1;
+
+  setup_attr(&call.attr, sp);
+  sp->nactions = setup_actions(&call.fa, sp);
+  schedrun(sp->sched, do_spawn, &call);
+  posix_spawn_file_actions_destroy(&call.fa);
+  posix_spawnattr_destroy(&call.attr);
+  if (call.cgfd >= 0)
+    Close(call.cgfd);
+
+  if (call.err) {
+    msg("%s: %s\n", name, strerror(call.err));
+    return -1;
+  }
+
+  return call.pid;
+}
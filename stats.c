@@ -0,0 +1,106 @@
+#include "shell.h"
+
+/* Phase timers: time spent in each phase of command execution is measured
+ * with the monotonic clock and accumulated in counters and a histogram with
+ * power of two buckets, so that taking a sample costs two clock readings
+ * and a few additions. */
+
+#define NBUCKETS 40 /* bucket k counts samples in [2^(k-1), 2^k) ns */
+
+typedef struct {
+  uint64_t count;             /* number of samples */
+  uint64_t total;             /* sum of samples in nanoseconds */
+  uint64_t min, max;          /* shortest and longest sample */
+  uint64_t bucket[NBUCKETS];  /* histogram */
+} phasestat_t;
+
+static const char *phasename[NPHASES] = {
+  [PH_TOKENIZE] = "tokenize", [PH_REDIR] = "redir",
+  [PH_BUILTIN] = "builtin",   [PH_LOOKUP] = "lookup",
+  [PH_SPAWN] = "spawn",       [PH_TTY] = "tty",
+  [PH_WAIT] = "wait",         [PH_COMPLETE] = "complete",
+};
+
+static phasestat_t stats[NPHASES];
+static uint64_t charged; /* time charged to all phases so far */
+
+/* Cost of setting up pipelines: system calls issued by the shell and file
+ * actions performed by children before they execute the program. */
+static struct {
+  uint64_t count;    /* number of pipelines */
+  uint64_t syscalls; /* sum over all pipelines */
+  int last;          /* of the most recent pipeline */
+} pipelines;
+
+/* Current value of the monotonic clock in nanoseconds. */
+uint64_t phasestart(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Charge `phase` with time elapsed since `start`. */
+void phaseend(int phase, uint64_t start) {
+  uint64_t ns = phasestart() - start;
+  phasestat_t *ps = &stats[phase];
+
+  if (ps->count == 0 || ns < ps->min)
+    ps->min = ns;
+  if (ns > ps->max)
+    ps->max = ns;
+  ps->count++;
+  ps->total += ns;
+  charged += ns;
+
+  int k = ns ? 64 - __builtin_clzll(ns) : 0;
+  ps->bucket[min(k, NBUCKETS - 1)]++;
+}
+
+/* Total time charged to phases, which lets a phase exclude nested ones. */
+uint64_t phasecharged(void) {
+  return charged;
+}
+
+void pipelinestats(int nsyscalls) {
+  pipelines.count++;
+  pipelines.syscalls += nsyscalls;
+  pipelines.last = nsyscalls;
+}
+
+void resetstats(void) {
+  memset(stats, 0, sizeof(stats));
+  memset(&pipelines, 0, sizeof(pipelines));
+}
+
+/* Print counters and non-empty histogram buckets of phases that were hit. */
+void showstats(void) {
+  printf("%-10s %8s %12s %10s %10s %10s\n", "phase", "count", "total[us]",
+         "avg[us]", "min[us]", "max[us]");
+
+  for (int i = 0; i < NPHASES; i++) {
+    phasestat_t *ps = &stats[i];
+    if (ps->count == 0)
+      continue;
+    printf("%-10s %8lu %12.1f %10.1f %10.1f %10.1f\n", phasename[i],
+           (unsigned long)ps->count, ps->total / 1e3,
+           ps->total / 1e3 / ps->count, ps->min / 1e3, ps->max / 1e3);
+  }
+
+  if (pipelines.count)
+    printf("pipelines %lu, system calls %lu, last %d\n",
+           (unsigned long)pipelines.count, (unsigned long)pipelines.syscalls,
+           pipelines.last);
+
+  for (int i = 0; i < NPHASES; i++) {
+    phasestat_t *ps = &stats[i];
+    if (ps->count == 0)
+      continue;
+    printf("%s:\n", phasename[i]);
+    for (int k = 0; k < NBUCKETS; k++) {
+      if (ps->bucket[k] == 0)
+        continue;
+      uint64_t lo = k ? 1ULL << (k - 1) : 0;
+      printf("  >= %12.3fus %8lu\n", lo / 1e3, (unsigned long)ps->bucket[k]);
+    }
+  }
+}
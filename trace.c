@@ -3,18 +3,35 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
 #include <termios.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <dlfcn.h>
 
+#include "trace.h"
+
 static int (*execve_p)(const char *path, char *const argv[],
                        char *const envp[]) = NULL;
 static int (*fork_p)(void) = NULL;
+static int (*posix_spawn_p)(pid_t *pid, const char *path,
+                            const posix_spawn_file_actions_t *fa,
+                            const posix_spawnattr_t *attr, char *const argv[],
+                            char *const envp[]) = NULL;
 static pid_t (*waitpid_p)(pid_t pid, int *status, int options) = NULL;
+static pid_t (*wait4_p)(pid_t pid, int *status, int options,
+                        struct rusage *ru) = NULL;
 static int (*dup2_p)(int oldfd, int newfd) = NULL;
 static int (*open_p)(const char *pathname, int flags, mode_t mode) = NULL;
 static int (*close_p)(int fd) = NULL;
@@ -50,20 +67,315 @@ static __attribute__((format(printf, 1, 2))) void report(const char *fmt, ...) {
   assert(m == n); /* Fail if write was not atomic! */
 }
 
+/* Latency histograms: each wrapper measures how long the real call took.
+ * When TRACE_HIST names a file, the histograms get appended to it when the
+ * process exits, before it calls execve, or when it receives SIGUSR2. The
+ * dump is formatted by hand, since snprintf is not async-signal-safe. If
+ * the signal arrives while `latency` updates the histograms, the handler
+ * leaves the dump to `latency`. */
+
+#define HIST_NBUCKETS 36 /* bucket k counts calls in [2^k, 2^(k+1)) ns */
+#define HIST_BUFSZ 16384
+
+typedef struct {
+  uint64_t count, total, max; /* in nanoseconds */
+  uint64_t bucket[HIST_NBUCKETS];
+} hist_t;
+
+static const char *callname[TR_NCALLS] = {
+  [TR_EXECVE] = "execve",   [TR_FORK] = "fork",
+  [TR_POSIX_SPAWN] = "posix_spawn", [TR_WAITPID] = "waitpid",
+  [TR_WAIT4] = "wait4",     [TR_OPEN] = "open",
+  [TR_CLOSE] = "close",     [TR_DUP2] = "dup2",
+  [TR_SETPGID] = "setpgid", [TR_KILL] = "kill",
+  [TR_TCSETPGRP] = "tcsetpgrp", [TR_TCSETATTR] = "tcsetattr",
+};
+
+static hist_t hist[TR_NCALLS];
+static const char *hist_path = NULL;
+static volatile sig_atomic_t hist_busy = 0; /* histograms are in use */
+static volatile sig_atomic_t hist_requested = 0; /* SIGUSR2 came meanwhile */
+
+static uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct {
+  char data[HIST_BUFSZ];
+  int len;
+} histbuf_t;
+
+/* Append `len` characters of `s` right-aligned in a field of `width`. */
+static void hist_put(histbuf_t *hb, const char *s, int len, int width) {
+  for (; width > len && hb->len < HIST_BUFSZ; width--)
+    hb->data[hb->len++] = ' ';
+  for (int i = 0; i < len && hb->len < HIST_BUFSZ; i++)
+    hb->data[hb->len++] = s[i];
+}
+
+static void hist_str(histbuf_t *hb, const char *s) {
+  hist_put(hb, s, strlen(s), 0);
+}
+
+static void hist_num(histbuf_t *hb, uint64_t n, int width) {
+  char digits[24];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  hist_put(hb, digits + i, sizeof(digits) - i, width);
+}
+
+/* Nanoseconds printed as microseconds with three decimal places. */
+static void hist_usec(histbuf_t *hb, uint64_t ns, int width) {
+  char digits[24];
+  int i = sizeof(digits);
+  for (int k = 0; k < 3; k++, ns /= 10)
+    digits[--i] = '0' + ns % 10;
+  digits[--i] = '.';
+  do {
+    digits[--i] = '0' + ns % 10;
+    ns /= 10;
+  } while (ns);
+  hist_put(hb, digits + i, sizeof(digits) - i, width);
+  hist_str(hb, "us");
+}
+
+/* Append histograms of calls made since the last dump in a single write,
+ * so that dumps of concurrent processes do not interleave. Must not be
+ * entered while `latency` updates the histograms. */
+static void hist_dump(void) {
+  static histbuf_t hb;
+
+  if (hist_path == NULL)
+    return;
+
+  hist_busy = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+  hb.len = 0;
+  for (int i = 0; i < TR_NCALLS; i++) {
+    hist_t *h = &hist[i];
+    if (h->count == 0)
+      continue;
+    hist_str(&hb, "[");
+    hist_num(&hb, getpid(), 0);
+    hist_str(&hb, "] ");
+    hist_str(&hb, callname[i]);
+    hist_str(&hb, ": count=");
+    hist_num(&hb, h->count, 0);
+    hist_str(&hb, " avg=");
+    hist_usec(&hb, h->total / h->count, 0);
+    hist_str(&hb, " max=");
+    hist_usec(&hb, h->max, 0);
+    hist_str(&hb, "\n");
+    for (int k = 0; k < HIST_NBUCKETS; k++) {
+      if (h->bucket[k] == 0)
+        continue;
+      hist_str(&hb, "  >= ");
+      hist_usec(&hb, 1ULL << k, 12);
+      hist_num(&hb, h->bucket[k], 9);
+      hist_str(&hb, "\n");
+    }
+  }
+  memset(hist, 0, sizeof(hist));
+
+  if (hb.len > 0) {
+    /* Functions were looked up by `hist_init`, dlsym is not safe here. */
+    int fd = open_p(hist_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (fd >= 0) {
+      ssize_t m = write(fd, hb.data, hb.len);
+      (void)m; /* there's nowhere to report an error */
+      close_p(fd);
+    }
+  }
+
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  hist_busy = 0;
+}
+
+/* Charge `call` with time elapsed since `start`. Runs between the wrapped
+ * call and the return to its caller, so it must preserve errno. */
+static void latency(int call, uint64_t start) {
+  uint64_t ns = now() - start;
+  hist_t *h = &hist[call];
+  int k = ns ? 63 - __builtin_clzll(ns) : 0;
+
+  hist_busy = 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  h->count++;
+  h->total += ns;
+  if (ns > h->max)
+    h->max = ns;
+  h->bucket[k < HIST_NBUCKETS ? k : HIST_NBUCKETS - 1]++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  hist_busy = 0;
+
+  if (hist_requested) {
+    int saved_errno = errno;
+    hist_requested = 0;
+    hist_dump();
+    errno = saved_errno;
+  }
+}
+
+static void hist_signal(int sig) {
+  int saved_errno = errno;
+  if (hist_busy)
+    hist_requested = 1;
+  else
+    hist_dump();
+  errno = saved_errno;
+}
+
+static __attribute__((constructor)) void hist_init(void) {
+  struct sigaction sa;
+
+  if ((hist_path = getenv("TRACE_HIST")) == NULL)
+    return;
+
+  xdlsym("open", (void **)&open_p);
+  xdlsym("close", (void **)&close_p);
+
+  /* Do not take over the signal if the program handles it itself. */
+  if (sigaction(SIGUSR2, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+    sa.sa_handler = hist_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+}
+
+static __attribute__((destructor)) void hist_fini(void) {
+  hist_dump();
+}
+
+static trace_ring_t *ring = NULL;
+static int ring_mode = 0; /* 0 if not known yet, 1 if binary, -1 if text */
+
+/* Identity of the process put into each event. It is fetched once instead
+ * of making two system calls per event, and forgotten whenever it might
+ * have changed, i.e. in a forked child or after setpgid. */
+static pid_t self_pid = 0, self_pgrp = 0;
+
+static void self_forget(void) {
+  self_pid = 0;
+  self_pgrp = 0;
+}
+
+static void self_init(void) {
+  if (self_pid == 0)
+    self_pid = getpid();
+  if (self_pgrp == 0)
+    self_pgrp = getpgrp();
+}
+
+/* Map the ring buffer file shared by all traced processes. If that fails
+ * the events are reported as text. */
+static void ring_init(void) {
+  const char *path = getenv("TRACE_RING");
+
+  ring_mode = -1;
+  if (path == NULL)
+    return;
+
+  pthread_atfork(NULL, NULL, self_forget);
+
+  xdlsym("open", (void **)&open_p);
+  xdlsym("close", (void **)&close_p);
+  int fd = open_p(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return;
+  if (ftruncate(fd, TRACE_RINGSZ) == 0) {
+    void *p = mmap(NULL, TRACE_RINGSZ, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    if (p != MAP_FAILED) {
+      ring = p;
+      ring->nevents = TRACE_NEVENTS;
+      ring->magic = TRACE_MAGIC;
+      ring_mode = 1;
+    }
+  }
+  close_p(fd);
+}
+
+/* Append an event to the ring buffer. Slot is claimed with an atomic
+ * increment, so concurrent processes never write to the same slot unless
+ * the ring wraps around. Returns false in text mode. */
+static bool record(int call, const char *str, int64_t arg0, int64_t arg1,
+                   int64_t arg2, int64_t result) {
+  if (ring_mode == 0)
+    ring_init();
+  if (ring_mode < 0)
+    return false;
+
+  uint64_t n = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  trace_event_t *ev = &ring->event[n & (TRACE_NEVENTS - 1)];
+
+  self_init();
+  __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+  /* Keep the contents from becoming visible before the slot is marked. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ev->time = now();
+  ev->pid = self_pid;
+  ev->pgrp = self_pgrp;
+  ev->call = call;
+  ev->arg[0] = arg0;
+  ev->arg[1] = arg1;
+  ev->arg[2] = arg2;
+  ev->result = result;
+  if (str)
+    strncpy(ev->str, str, TRACE_STRSZ - 1);
+  ev->str[TRACE_STRSZ - 1] = '\0';
+  /* Readers ignore the event until its sequence number is published. */
+  __atomic_store_n(&ev->seq, n + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
 int execve(const char *path, char *const argv[], char *const envp[]) {
   xdlsym("execve", (void **)&execve_p);
-  report("execve(\"%s\", %p, %p)", path, argv, envp);
-  return execve_p(path, argv, envp);
+  if (!record(TR_EXECVE, path, (intptr_t)argv, (intptr_t)envp, 0, 0))
+    report("execve(\"%s\", %p, %p)", path, argv, envp);
+  /* Successful execve never returns, so only failures are timed. */
+  hist_dump();
+  uint64_t start = now();
+  int res = execve_p(path, argv, envp);
+  latency(TR_EXECVE, start);
+  return res;
 }
 
 int fork(void) {
   xdlsym("fork", (void **)&fork_p);
+  uint64_t start = now();
   pid_t child = fork_p();
   if (child)
+    latency(TR_FORK, start);
+  if (child && !record(TR_FORK, NULL, 0, 0, 0, child))
     report("fork() = %d", child);
   return child;
 }
 
+/* The child performs file actions and execve internally,
+ * so it is reported by the parent as a single event. */
+int posix_spawn(pid_t *pid, const char *path,
+                const posix_spawn_file_actions_t *fa,
+                const posix_spawnattr_t *attr, char *const argv[],
+                char *const envp[]) {
+  xdlsym("posix_spawn", (void **)&posix_spawn_p);
+  uint64_t start = now();
+  int res = posix_spawn_p(pid, path, fa, attr, argv, envp);
+  latency(TR_POSIX_SPAWN, start);
+  if (!record(TR_POSIX_SPAWN, path, (intptr_t)argv, (intptr_t)envp, 0,
+              res ? -1 : *pid))
+    report("posix_spawn(\"%s\", %p, %p) = %d", path, argv, envp,
+           res ? -1 : *pid);
+  return res;
+}
+
 #define _SN(x) [x] = #x
 
 static const char *signame[NSIG] = {
@@ -76,73 +388,127 @@ static const char *signame[NSIG] = {
 
 #undef _SN
 
-pid_t waitpid(pid_t pid, int *statusp, int options) {
-  int status;
-  xdlsym("waitpid", (void **)&waitpid_p);
-  pid = waitpid_p(pid, &status, options);
+static void report_wait(int call, pid_t pid, int status) {
+  const char *name = (call == TR_WAIT4) ? "wait4" : "waitpid";
+
+  if (record(call, NULL, status, 0, 0, pid))
+    return;
+
   if (pid <= 0) {
-    report("waitpid(...) -> {}");
+    report("%s(...) -> {}", name);
   } else if (WIFCONTINUED(status)) {
-    report("waitpid(...) -> {pid=%d, status=SIGCONT}", pid);
+    report("%s(...) -> {pid=%d, status=SIGCONT}", name, pid);
   } else if (WIFSTOPPED(status)) {
-    report("waitpid(...) -> {pid=%d, status=%s}", pid,
+    report("%s(...) -> {pid=%d, status=%s}", name, pid,
            signame[WSTOPSIG(status)]);
   } else if (WIFSIGNALED(status)) {
-    report("waitpid(...) -> {pid=%d, status=%s}", pid,
+    report("%s(...) -> {pid=%d, status=%s}", name, pid,
            signame[WTERMSIG(status)]);
   } else if (WIFEXITED(status)) {
-    report("waitpid(...) -> {pid=%d, status=%d}", pid, WEXITSTATUS(status));
+    report("%s(...) -> {pid=%d, status=%d}", name, pid, WEXITSTATUS(status));
   }
+}
+
+pid_t waitpid(pid_t pid, int *statusp, int options) {
+  int status;
+  xdlsym("waitpid", (void **)&waitpid_p);
+  uint64_t start = now();
+  pid = waitpid_p(pid, &status, options);
+  latency(TR_WAITPID, start);
+  report_wait(TR_WAITPID, pid, status);
+  if (statusp)
+    *statusp = status;
+  return pid;
+}
+
+pid_t wait4(pid_t pid, int *statusp, int options, struct rusage *ru) {
+  int status;
+  xdlsym("wait4", (void **)&wait4_p);
+  uint64_t start = now();
+  pid = wait4_p(pid, &status, options, ru);
+  latency(TR_WAIT4, start);
+  report_wait(TR_WAIT4, pid, status);
   if (statusp)
     *statusp = status;
   return pid;
 }
 
-int open(const char *pathname, int flags, mode_t mode) {
+/* Declared in <fcntl.h> with variable number of arguments. */
+int open(const char *pathname, int flags, ...) {
+  mode_t mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
   xdlsym("open", (void **)&open_p);
+  uint64_t start = now();
   int res = open_p(pathname, flags, mode);
-  report("open(\"%s\", %d, %d) = %d", pathname, flags, mode, res);
+  latency(TR_OPEN, start);
+  if (!record(TR_OPEN, pathname, flags, mode, 0, res))
+    report("open(\"%s\", %d, %d) = %d", pathname, flags, mode, res);
   return res;
 }
 
 int close(int fd) {
   xdlsym("close", (void **)&close_p);
+  uint64_t start = now();
   int res = close_p(fd);
-  report("close(%d) = %d", fd, res);
+  latency(TR_CLOSE, start);
+  if (!record(TR_CLOSE, NULL, fd, 0, 0, res))
+    report("close(%d) = %d", fd, res);
   return res;
 }
 
 int dup2(int oldfd, int newfd) {
   xdlsym("dup2", (void **)&dup2_p);
+  uint64_t start = now();
   int res = dup2_p(oldfd, newfd);
-  report("dup2(%d, %d) = %d", oldfd, newfd, res);
+  latency(TR_DUP2, start);
+  if (!record(TR_DUP2, NULL, oldfd, newfd, 0, res))
+    report("dup2(%d, %d) = %d", oldfd, newfd, res);
   return res;
 }
 
 int setpgid(pid_t pid, pid_t pgid) {
   xdlsym("setpgid", (void **)&setpgid_p);
+  uint64_t start = now();
   int res = setpgid_p(pid, pgid);
-  report("setpgid(%d, %d) = %d", pid, pgid, res);
+  latency(TR_SETPGID, start);
+  if (res == 0)
+    self_pgrp = 0;
+  if (!record(TR_SETPGID, NULL, pid, pgid, 0, res))
+    report("setpgid(%d, %d) = %d", pid, pgid, res);
   return res;
 }
 
 int kill(pid_t pid, int sig) {
   xdlsym("kill", (void **)&kill_p);
+  uint64_t start = now();
   int res = kill_p(pid, sig);
-  report("kill(%d, %s) = %d", pid, signame[sig], res);
+  latency(TR_KILL, start);
+  if (!record(TR_KILL, NULL, pid, sig, 0, res))
+    report("kill(%d, %s) = %d", pid, signame[sig], res);
   return res;
 }
 
 int tcsetpgrp(int fd, pid_t pgrp) {
   xdlsym("tcsetpgrp", (void **)&tcsetpgrp_p);
+  uint64_t start = now();
   int res = tcsetpgrp_p(fd, pgrp);
-  report("tcsetpgrp(%d, %d) = %d", fd, pgrp, res);
+  latency(TR_TCSETPGRP, start);
+  if (!record(TR_TCSETPGRP, NULL, fd, pgrp, 0, res))
+    report("tcsetpgrp(%d, %d) = %d", fd, pgrp, res);
   return res;
 }
 
 int tcsetattr(int fd, int action, const struct termios *t) {
   xdlsym("tcsetattr", (void **)&tcsetattr_p);
+  uint64_t start = now();
   int res = tcsetattr_p(fd, action, t);
-  report("tcsetattr(%d, %d, %p) = %d", fd, action, t, res);
+  latency(TR_TCSETATTR, start);
+  if (!record(TR_TCSETATTR, NULL, fd, action, (intptr_t)t, res))
+    report("tcsetattr(%d, %d, %p) = %d", fd, action, t, res);
   return res;
 }
@@ -0,0 +1,53 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* Binary tracing mode of trace.so, enabled by setting TRACE_RING to a path
+ * of a file (e.g. in /dev/shm). All traced processes map the file and
+ * append fixed-size events to a ring buffer stored in it, without making
+ * any system calls. Contents of the file are printed with `tracedump`. */
+
+#define TRACE_MAGIC 0x54524143 /* "TRAC" */
+#define TRACE_NEVENTS 65536    /* must be a power of two */
+#define TRACE_STRSZ 32
+
+/* Intercepted calls. */
+enum {
+  TR_EXECVE,
+  TR_FORK,
+  TR_POSIX_SPAWN,
+  TR_WAITPID,
+  TR_WAIT4,
+  TR_OPEN,
+  TR_CLOSE,
+  TR_DUP2,
+  TR_SETPGID,
+  TR_KILL,
+  TR_TCSETPGRP,
+  TR_TCSETATTR,
+  TR_NCALLS
+};
+
+typedef struct {
+  uint64_t seq;          /* position in the stream plus one, 0 if unfinished */
+  uint64_t time;         /* CLOCK_MONOTONIC in nanoseconds */
+  int32_t pid, pgrp;     /* process that made the call */
+  int32_t call;          /* one of TR_* */
+  int32_t pad;
+  int64_t arg[3];        /* integer and pointer arguments */
+  int64_t result;        /* returned value */
+  char str[TRACE_STRSZ]; /* path argument, possibly truncated */
+} trace_event_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t nevents;       /* number of slots in the ring */
+  uint64_t head;          /* number of events ever recorded */
+  trace_event_t event[];  /* event number `n` is in slot n % nevents */
+} trace_ring_t;
+
+#define TRACE_RINGSZ \
+  (sizeof(trace_ring_t) + TRACE_NEVENTS * sizeof(trace_event_t))
+
+#endif /* !_TRACE_H_ */
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "trace.h"
+
+/* Prints events recorded by trace.so in binary mode, oldest first, in the
+ * same format trace.so uses in text mode, prefixed with a timestamp relative
+ * to the first event printed. Events overwritten or being written while the
+ * dump is taken are skipped. */
+
+static const char *signame(int sig) {
+  static char buf[16];
+  const char *abbrev = sigabbrev_np(sig);
+  if (abbrev == NULL)
+    return "?";
+  snprintf(buf, sizeof(buf), "SIG%s", abbrev);
+  return buf;
+}
+
+static void print_wait(const char *name, const trace_event_t *ev) {
+  int pid = ev->result, status = ev->arg[0];
+
+  printf("%s(...) -> {", name);
+  if (pid <= 0)
+    printf("}\n");
+  else if (WIFCONTINUED(status))
+    printf("pid=%d, status=SIGCONT}\n", pid);
+  else if (WIFSTOPPED(status))
+    printf("pid=%d, status=%s}\n", pid, signame(WSTOPSIG(status)));
+  else if (WIFSIGNALED(status))
+    printf("pid=%d, status=%s}\n", pid, signame(WTERMSIG(status)));
+  else
+    printf("pid=%d, status=%d}\n", pid, WEXITSTATUS(status));
+}
+
+static void print_event(const trace_event_t *ev, uint64_t start) {
+  const int64_t *arg = ev->arg;
+  int res = ev->result;
+
+  printf("%12.6f [%d:%d] ", (ev->time - start) / 1e9, ev->pid, ev->pgrp);
+
+  switch (ev->call) {
+    case TR_EXECVE:
+      printf("execve(\"%s\", %p, %p)\n", ev->str, (void *)arg[0],
+             (void *)arg[1]);
+      break;
+    case TR_FORK:
+      printf("fork() = %d\n", res);
+      break;
+    case TR_POSIX_SPAWN:
+      printf("posix_spawn(\"%s\", %p, %p) = %d\n", ev->str, (void *)arg[0],
+             (void *)arg[1], res);
+      break;
+    case TR_WAITPID:
+      print_wait("waitpid", ev);
+      break;
+    case TR_WAIT4:
+      print_wait("wait4", ev);
+      break;
+    case TR_OPEN:
+      printf("open(\"%s\", %d, %d) = %d\n", ev->str, (int)arg[0], (int)arg[1],
+             res);
+      break;
+    case TR_CLOSE:
+      printf("close(%d) = %d\n", (int)arg[0], res);
+      break;
+    case TR_DUP2:
+      printf("dup2(%d, %d) = %d\n", (int)arg[0], (int)arg[1], res);
+      break;
+    case TR_SETPGID:
+      printf("setpgid(%d, %d) = %d\n", (int)arg[0], (int)arg[1], res);
+      break;
+    case TR_KILL:
+      printf("kill(%d, %s) = %d\n", (int)arg[0], signame(arg[1]), res);
+      break;
+    case TR_TCSETPGRP:
+      printf("tcsetpgrp(%d, %d) = %d\n", (int)arg[0], (int)arg[1], res);
+      break;
+    case TR_TCSETATTR:
+      printf("tcsetattr(%d, %d, %p) = %d\n", (int)arg[0], (int)arg[1],
+             (void *)arg[2], res);
+      break;
+    default:
+      printf("unknown call %d\n", ev->call);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  if ((size_t)sb.st_size < sizeof(trace_ring_t)) {
+    fprintf(stderr, "%s: not a trace ring buffer\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  trace_ring_t *ring = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+  if (ring->magic != TRACE_MAGIC ||
+      sb.st_size < sizeof(trace_ring_t) +
+                     (size_t)ring->nevents * sizeof(trace_event_t)) {
+    fprintf(stderr, "%s: not a trace ring buffer\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t n = (head > ring->nevents) ? head - ring->nevents : 0;
+  uint64_t start = 0;
+
+  for (; n < head; n++) {
+    const trace_event_t *slot = &ring->event[n % ring->nevents];
+    trace_event_t ev;
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+      continue;
+    memcpy(&ev, slot, sizeof(ev));
+    /* Writer could have reused the slot while we were copying it. The fence
+     * keeps the copy from being reordered after the check. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != n + 1)
+      continue;
+
+    if (start == 0)
+      start = ev.time;
+    print_event(&ev, start);
+  }
+
+  return EXIT_SUCCESS;
+}